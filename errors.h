@@ -32,6 +32,7 @@
 #define EIO 5 /**< I/O error */
 #define ENOMEM 12 /**< Out of memory */
 #define EBUSY 16 /**< Device or resource is busy */
+#define EEXIST 17 /**< Already exists */
 #define ENODEV 19 /**< No such device */
 #define EINVAL 22 /**< Invalid Argument */
 #define ETIME 62 /**< Timer expired */
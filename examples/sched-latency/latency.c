@@ -0,0 +1,158 @@
+/*
+ * Measures the worst-case time interrupts are held off while the
+ * scheduler is busy.
+ *
+ * A probe timer overflows at the high interrupt level, and its hook reads
+ * the timer count, which is how many cycles ago the overflow happened.
+ * Nothing else runs at the high level, so the spread between the lowest
+ * and highest count is how long the probe was kept waiting, ie the
+ * longest stretch with interrupts off, plus the odd multi-cycle
+ * instruction. The probe also toggles a pin, for watching the jitter on
+ * a scope.
+ *
+ * Meanwhile the low level timer adds tasks at both priorities, a medium
+ * level timer adds tasks much faster, and the main loop runs them, along
+ * with a task which keeps adding itself back. Every second the spread is
+ * printed and reset.
+ *
+ * Only sched_simple_init(), sched_run() and sched_simple() are used, with
+ * sched_now and sched_later, so this builds against the scheduler before
+ * and after interrupts stopped being turned off to add and run tasks.
+ * Build it against both to compare them. The seconds are counted here
+ * rather than with the scheduler timers, which the older one lacks. The
+ * USART driver prints from the main loop, so anything it turns
+ * interrupts off for shows up too, on either build.
+ */
+
+#define F_CPU 32000000
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdio.h>
+#include "global.h"
+#include <util/delay.h>
+#include "usart.h"
+#include "kakapo.h"
+#include "timer.h"
+#include "sched_simple.h"
+
+/* probe period in cycles, prime so it drifts across the other timers */
+#define PROBE_PERIOD 997
+
+void probe(void);
+void lo_hook(void);
+void med_hook(void);
+void work_task(void *data);
+void churn_task(void *data);
+void report_task(void *data);
+
+/* cycles from overflow to the probe reading the count */
+volatile uint16_t lat_min = 0xffff;
+volatile uint16_t lat_max = 0;
+
+/* the spread over the last second, handed over by the probe when asked,
+ * so reading it never needs interrupts turned off */
+volatile uint8_t lat_take;
+volatile uint16_t snap_min, snap_max;
+
+/* low level timer overflows, 1ms each */
+volatile uint16_t lo_count;
+
+int main(void) {
+    kakapo_init();
+
+    sei();
+
+    usart_init(usart_d0, 128, 128);
+    usart_conf(usart_d0, 115200, 8, none, 1, 0, NULL);
+    usart_map_stdio(usart_d0);
+    usart_run(usart_d0);
+
+    // this is required to force FTDI chip to resync
+    putchar(0);
+    _delay_ms(1);
+
+    printf("scheduler interrupt latency, in cycles\r\n");
+
+    sched_simple_init(16);
+
+    /* probe pin, on the yellow LED */
+    PORTE.DIRSET = PIN3_bm;
+
+    /* tasks and the seconds every 1ms, at the low level */
+    timer_init(timer_c0,timer_norm,32000,NULL,&lo_hook);
+    /* more tasks every 50us, at the medium level */
+    timer_init(timer_c1,timer_norm,1600,NULL,&med_hook);
+    TCC1.INTCTRLA = TC_OVFINTLVL_MED_gc;
+    /* and the probe at the high level */
+    timer_init(timer_d0,timer_norm,PROBE_PERIOD,NULL,&probe);
+    TCD0.INTCTRLA = TC_OVFINTLVL_HI_gc;
+    PMIC.CTRL |= PMIC_MEDLVLEN_bm | PMIC_HILVLEN_bm;
+
+    timer_clk(timer_c0,timer_perdiv1);
+    timer_clk(timer_c1,timer_perdiv1);
+    timer_clk(timer_d0,timer_perdiv1);
+
+    sched_run(&churn_task,NULL,sched_later);
+
+    /* no sleeping, waking from sleep would count as latency */
+    while (1) {
+        sched_simple();
+    }
+
+    return 0;
+}
+
+void probe(void) {
+    uint16_t lat = TCD0.CNT;
+
+    PORTE.OUTTGL = PIN3_bm;
+    if (lat < lat_min) {
+        lat_min = lat;
+    }
+    if (lat > lat_max) {
+        lat_max = lat;
+    }
+    if (lat_take) {
+        snap_min = lat_min;
+        snap_max = lat_max;
+        lat_min = 0xffff;
+        lat_max = 0;
+        lat_take = 0;
+    }
+}
+
+void lo_hook(void) {
+    sched_run(&work_task,NULL,sched_later);
+    sched_run(&work_task,NULL,sched_now);
+    if (++lo_count >= 1000) {
+        lo_count = 0;
+        sched_run(&report_task,NULL,sched_now);
+    }
+}
+
+void med_hook(void) {
+    sched_run(&work_task,NULL,sched_now);
+}
+
+void work_task(void *data) {
+    return;
+}
+
+/* keep the run queue busy from the main context too */
+void churn_task(void *data) {
+    sched_run(&churn_task,NULL,sched_later);
+}
+
+void report_task(void *data) {
+    static uint8_t asked = 0;
+
+    /* the probe took the spread when we asked, the next time it ran, so
+     * this is the last second's */
+    if (asked && !lat_take) {
+        printf("min %u max %u held off %u\r\n", snap_min, snap_max,
+            snap_max - snap_min);
+    }
+    asked = 1;
+    lat_take = 1;
+}
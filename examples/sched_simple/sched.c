@@ -1,7 +1,7 @@
 /*
  * An example of several tasks running, using sched_simple.
  * Task A echos USART characters.
- * Task B blinks an LED when a timer expires.
+ * Task B blinks an LED every second, using a software timer.
 */
 
 #define F_CPU 32000000
@@ -29,11 +29,9 @@ void led_task(void *data);
 
 /* a prototype to hook the USART recieve event */
 void usart_rxhook(uint8_t c);
-/* a prototype to hook the timer overflow */
-void timer_ovfhook(void);
 
-/* used as a counter to cut down how often that 1ms timer fires the task */
-uint16_t count;
+/* the usart task is registered, so it is only ever queued once */
+sched_task_t usart_t;
 
 int main(void) {
     kakapo_init();
@@ -52,18 +50,23 @@ int main(void) {
     _delay_ms(1);
 
     printf("scheduler test\r\n");
-    /* initalise scheduler with 4-deep run queue */
+    /* initalise scheduler with 4-deep run queue, and up to 4 timers */
     sched_simple_init(4);
+    sched_timer_init(4);
+    sched_task_init(&usart_t,&usart_task,NULL,sched_later);
 
-    count = 0;
-
-    /* set up the timer to fire now and then */
-    timer_init(timer_c0,timer_norm,32000,NULL,&timer_ovfhook);
+    /* the scheduler ticks every 1ms from the timer overflow */
+    timer_init(timer_c0,timer_norm,32000,NULL,&sched_tick);
     timer_clk(timer_c0,timer_perdiv1);
 
+    /* 1000 ticks between toggles */
+    sched_run_every(&led_task,NULL,1000);
+
     while (1) {
-        /* don't bother sleeping, just constantly try to run something */
+        /* run everything, then sleep until an interrupt adds more. the
+         * USART and timer are running, so this will be idle mode */
         sched_simple();
+        sched_idle();
     }
 
     return 0;
@@ -92,13 +95,6 @@ void led_task(void *data) {
 }
 
 void usart_rxhook(uint8_t c) {
-    sched_run(&usart_task,NULL,sched_later);
-}
-
-void timer_ovfhook(void) {
-    count++;
-    if (count == 1000) { // 1000ms between toggles
-        count = 0;
-        sched_run(&led_task,NULL,sched_now);
-    }
+    /* usart_task drains everything, so only queue it once */
+    sched_task_run(&usart_t);
 }
@@ -0,0 +1,196 @@
+/* Copyright (C) 2015 David Zanetti
+ *
+ * This file is part of libkakapo.
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Typed fixed-element queues, generated by macro */
+
+#ifndef QUEUE_H_INCLUDED
+#define QUEUE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include "errors.h"
+
+/** \file
+ *  \brief Typed queue generator
+ *
+ *  These are the ringbuffer.h design applied to elements of any fixed
+ *  size type, eg a struct of ADC samples or a packet descriptor. The
+ *  queue is sized by a power of two, wrapped by bit masking, and holds
+ *  one element less than its size.
+ *
+ *  QUEUE_TYPE(name, type) generates a name_t queue type holding elements
+ *  of type, and static inline functions to operate on it:
+ *
+ *  + name_init(q, buf, len) adopts storage for len elements
+ *
+ *  + name_reset(q) discards everything in the queue
+ *
+ *  + name_push(q, &elem) and name_pop(q, &elem) copy an element in or
+ *    out, returning 1 on success and 0 if full/empty
+ *
+ *  + name_peek(q) returns a pointer to the oldest element in place, or
+ *    NULL if empty, and name_drop(q) consumes it
+ *
+ *  + name_used(q) and name_empty(q) report the fill level
+ *
+ *  As with ringbuffers, push/pop/peek/drop are lock-free for one producer
+ *  and one consumer, which may be in different interrupt contexts. The
+ *  _unsafe versions of push and pop must not be used concurrently with
+ *  anything else on the same queue.
+ *
+ *  QUEUE_DEFINE(name, var, size) creates static storage for a queue in
+ *  .bss, checking the size at compile time, and QUEUE_INIT(name, var)
+ *  sets it up.
+ */
+
+/* maximum number of elements in a queue */
+#define QUEUE_MAX 256
+
+/* stop gcc moving element accesses across an index update */
+#define _queue_barrier() __asm__ __volatile__ ("" ::: "memory")
+
+/* access an index which the other side of the queue may also access */
+#define _queue_idx(idx) (*(volatile uint8_t *)&(idx))
+
+/** \brief Generate a typed queue
+ *  \param name Prefix for the generated type and functions
+ *  \param type Type of each element
+ */
+#define QUEUE_TYPE(name, type) \
+typedef type name##_elem_t; \
+typedef struct { \
+	type *buf; \
+	uint8_t head; \
+	uint8_t tail; \
+	uint8_t mask; \
+} name##_t; \
+\
+static inline int name##_init(name##_t *q, type *buf, uint16_t len) { \
+	if (!q || !buf || len < 2 || len > QUEUE_MAX || len & (len-1)) { \
+		return -EINVAL; \
+	} \
+	q->buf = buf; \
+	q->head = 0; \
+	q->tail = 0; \
+	q->mask = len-1; \
+	return 0; \
+} \
+\
+static inline void name##_reset(name##_t *q) { \
+	q->head = 0; \
+	q->tail = 0; \
+} \
+\
+static inline uint8_t name##_push(name##_t *q, const type *elem) { \
+	uint8_t next = (q->head + 1) & q->mask; \
+	if (next == _queue_idx(q->tail)) { \
+		return 0; \
+	} \
+	_queue_barrier(); \
+	q->buf[next] = *elem; \
+	_queue_barrier(); \
+	_queue_idx(q->head) = next; \
+	return 1; \
+} \
+\
+static inline uint8_t name##_push_unsafe(name##_t *q, const type *elem) { \
+	uint8_t next = (q->head + 1) & q->mask; \
+	if (next == q->tail) { \
+		return 0; \
+	} \
+	q->buf[next] = *elem; \
+	q->head = next; \
+	return 1; \
+} \
+\
+static inline type *name##_peek(name##_t *q) { \
+	if (q->tail == _queue_idx(q->head)) { \
+		return NULL; \
+	} \
+	_queue_barrier(); \
+	return &q->buf[(q->tail + 1) & q->mask]; \
+} \
+\
+static inline void name##_drop(name##_t *q) { \
+	_queue_barrier(); \
+	_queue_idx(q->tail) = (q->tail + 1) & q->mask; \
+} \
+\
+static inline uint8_t name##_pop(name##_t *q, type *elem) { \
+	type *p = name##_peek(q); \
+	if (!p) { \
+		return 0; \
+	} \
+	*elem = *p; \
+	name##_drop(q); \
+	return 1; \
+} \
+\
+static inline uint8_t name##_pop_unsafe(name##_t *q, type *elem) { \
+	if (q->tail == q->head) { \
+		return 0; \
+	} \
+	q->tail = (q->tail + 1) & q->mask; \
+	*elem = q->buf[q->tail]; \
+	return 1; \
+} \
+\
+static inline uint8_t name##_used(name##_t *q) { \
+	return (_queue_idx(q->head) - _queue_idx(q->tail)) & q->mask; \
+} \
+\
+static inline uint8_t name##_empty(name##_t *q) { \
+	return (_queue_idx(q->head) == _queue_idx(q->tail)); \
+}
+
+/** \brief Define static storage for a queue generated by QUEUE_TYPE()
+ *
+ *  Creates a name_t called var, and an array of size elements called
+ *  var_buf, in .bss. A size which is not a power of two or larger than
+ *  QUEUE_MAX fails with a negative array size error mentioning
+ *  var_size_check.
+ *
+ *  \param name Prefix given to QUEUE_TYPE()
+ *  \param var Name of the queue variable
+ *  \param size Number of elements, a power of two
+ */
+#define QUEUE_DEFINE(name, var, size) \
+	typedef char var##_size_check[((size) > 1 && (size) <= QUEUE_MAX && \
+		!((size) & ((size) - 1))) ? 1 : -1]; \
+	name##_elem_t var##_buf[(size)]; \
+	name##_t var
+
+/** \brief Initialise a queue defined with QUEUE_DEFINE()
+ *  \param name Prefix given to QUEUE_TYPE()
+ *  \param var Name of the queue variable
+ *  \return 0 on success, errors.h otherwise
+ */
+#define QUEUE_INIT(name, var) \
+	name##_init(&var, var##_buf, sizeof(var##_buf)/sizeof(var##_buf[0]))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // QUEUE_H_INCLUDED
@@ -0,0 +1,37 @@
+/* Copyright (C) 2015 David Zanetti
+ *
+ * This file is part of libkakapo.
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* ringbuffer handler, 16 bit indexes */
+
+#include <stdio.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errors.h"
+#include "ring16.h"
+
+#define RING_T ring16_t
+#define RING_FN(fn) ring16_##fn
+#define RING_IDX_T ring16_idx_t
+#define RING_MAX RING16_MAX
+#define RING_WIDE
+
+#include "ring_impl.h"
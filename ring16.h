@@ -0,0 +1,135 @@
+/* Copyright (C) 2015 David Zanetti
+ *
+ * This file is part of libkakapo.
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Public interface to ringbuffers with 16 bit indexes */
+
+#ifndef RING16_H_INCLUDED
+#define RING16_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "ringbuffer.h"
+
+/** \file
+ *  \brief Large ringbuffer public interface
+ *
+ *  ring16_t is ringbuffer_t with 16 bit indexes, for ringbuffers larger
+ *  than 256 bytes, up to 32kB. Every ring_ function in ringbuffer.h has a
+ *  ring16_ equivalent which behaves the same way, and the RING_F_ flags
+ *  are shared.
+ *
+ *  The safe versions are still SPSC, but the 16 bit indexes cannot be
+ *  loaded or stored in one instruction, so each index access disables
+ *  interrupts for two instructions. Only use these where the size is
+ *  needed, a ringbuffer_t never disables interrupts.
+ */
+
+/** \brief Index type of a ring16_t */
+typedef uint16_t ring16_idx_t;
+/* maximum size of a ring16_t */
+#define RING16_MAX 32768
+
+/** \struct ring16_t
+ *  \brief Buffer and metadata for a ringbuffer with 16 bit indexes
+ */
+typedef struct ring16_s {
+		char *buf;      /**< The actual ringbuffer storage */
+		ring16_idx_t head;   /**< Head pointer */
+		ring16_idx_t tail;   /**< Tail pointer */
+		ring16_idx_t mask;   /**< Mask to wrap ringbuffer */
+		uint8_t flags;  /**< Ringbuffer flags, see RING_F_ */
+		uint16_t dropped; /**< Characters lost to a full ringbuffer */
+		ring16_idx_t peak;   /**< Most characters ever held, producer owned */
+		ring16_idx_t wm_high; /**< High watermark, see ring16_watermark() */
+		ring16_idx_t wm_low;  /**< Low watermark, see ring16_watermark() */
+		void (*high_fn)(struct ring16_s *); /**< High watermark hook */
+		void (*low_fn)(struct ring16_s *);  /**< Low watermark hook */
+} ring16_t;
+
+/** \brief Define a ring16_t with static storage, see RING_DEFINE()
+ *  \param name Name of the ringbuffer
+ *  \param size Size of the ringbuffer in bytes, a power of two
+ */
+#define RING16_DEFINE(name, size) \
+	typedef char name##_size_check[((size) > 1 && (size) <= RING16_MAX && \
+		!((size) & ((size) - 1))) ? 1 : -1]; \
+	char name##_buf[(size)]; \
+	ring16_t name
+
+/** \brief Initialise a ring16_t defined with RING16_DEFINE()
+ *  \param name Name of the ringbuffer
+ *  \return 0 on success, errors.h otherwise
+ */
+#define RING16_INIT(name) \
+	ring16_init_static(&name, name##_buf, sizeof(name##_buf), RING_F_NONE)
+
+/** \brief Initialise a ring16_t defined with RING16_DEFINE(), with flags
+ *  \param name Name of the ringbuffer
+ *  \param flags Mode flags, see ring_create_flags()
+ *  \return 0 on success, errors.h otherwise
+ */
+#define RING16_INIT_FLAGS(name, flags) \
+	ring16_init_static(&name, name##_buf, sizeof(name##_buf), (flags))
+
+/* see the ring_ equivalents in ringbuffer.h for these */
+
+ring16_t *ring16_create(uint16_t len);
+ring16_t *ring16_create_flags(uint16_t len, uint8_t flags);
+int ring16_init_static(ring16_t *ring, char *buf, uint16_t len,
+	uint8_t flags);
+void ring16_reset(ring16_t *ring);
+void ring16_destroy(ring16_t *ring);
+
+uint8_t ring16_write(ring16_t *ring, char value);
+uint8_t ring16_write_unsafe(ring16_t *ring, char value);
+char ring16_read(ring16_t *ring);
+char ring16_read_unsafe(ring16_t *ring);
+
+uint16_t ring16_write_block(ring16_t *ring, const char *buf, uint16_t len);
+uint16_t ring16_write_block_unsafe(ring16_t *ring, const char *buf, uint16_t len);
+uint16_t ring16_read_block(ring16_t *ring, char *buf, uint16_t len);
+uint16_t ring16_read_block_unsafe(ring16_t *ring, char *buf, uint16_t len);
+
+uint16_t ring16_peek_read(ring16_t *ring, char **ptr);
+void ring16_commit_read(ring16_t *ring, uint16_t len);
+uint16_t ring16_peek_write(ring16_t *ring, char **ptr);
+void ring16_commit_write(ring16_t *ring, uint16_t len);
+
+uint8_t ring16_readable(ring16_t *ring);
+uint8_t ring16_readable_unsafe(ring16_t *ring);
+uint16_t ring16_used(ring16_t *ring);
+uint16_t ring16_free(ring16_t *ring);
+
+int ring16_watermark(ring16_t *ring, uint16_t high,
+	void (*high_fn)(ring16_t *), uint16_t low,
+	void (*low_fn)(ring16_t *));
+uint16_t ring16_peak(ring16_t *ring);
+void ring16_peak_reset(ring16_t *ring);
+uint16_t ring16_dropped(ring16_t *ring);
+void ring16_dropped_reset(ring16_t *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RING16_H_INCLUDED
@@ -0,0 +1,439 @@
+/* Copyright (C) 2009-2014 David Zanetti
+ *
+ * This file is part of libkakapo.
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* ringbuffer implementation, shared by the 8 and 16 bit index versions */
+
+/* Not a public header. Included by ringbuffer.c and ring16.c after
+ * defining:
+ *
+ * RING_T       the ringbuffer type
+ * RING_FN(fn)  public name of function fn
+ * RING_IDX_T   the index type
+ * RING_MAX     the largest size allowed
+ * RING_WIDE    if the index type is wider than a byte
+ */
+
+/** \file
+ *  \brief Ringbuffer implementation
+ *
+ *  Ringbuffers are circular buffer which can be read from or written to,
+ *  with independant read and write pointers. They must be sized by a power
+ *  of two, since this implementation uses simple bit masking to implement
+ *  wrapping.
+ *
+ *  Functions come in normal and 'unsafe' version. In the unsafe versions you
+ *  must ensure that no concurrent access to a single ringbuffer is possible.
+ *  The normal (safe) versions are lock-free for one producer and one
+ *  consumer (SPSC), which may be in different interrupt contexts:
+ *
+ *  + only the producer ever stores head, and only the consumer stores tail
+ *
+ *  + the producer stores the character before publishing the new head,
+ *    and the consumer loads the character before publishing the new tail
+ *
+ *  + each side loads the other side's index exactly once per operation
+ *
+ *  The AVR core does not reorder memory accesses, so a compiler barrier is
+ *  all that is needed to keep the ordering. 8 bit indexes are published
+ *  with a single byte store, which is atomic. The 16 bit indexes of ring16_t
+ *  are not, so their loads and stores are wrapped in a (two instruction
+ *  long) interrupt disable to stop the other side seeing half an update.
+ *  ringbuffer_t never disables interrupts.
+ *
+ *  The unsafe versions are still fine to use from inside an ISR which is
+ *  the only producer or consumer of a ring, since nothing else can run on
+ *  that side of the ring until the ISR completes.
+ */
+
+/* create a ringbuffer, allocating the appropriate space for it's metadata and ring size */
+/* must be a power of two */
+
+RING_T *RING_FN(create)(uint16_t len) {
+	return RING_FN(create_flags)(len, RING_F_NONE);
+}
+
+RING_T *RING_FN(create_flags)(uint16_t len, uint8_t flags) {
+	RING_T *ring = NULL;
+
+    /* check to see length is power of 2 and not excessive */
+    if (len > RING_MAX || len & (len-1) || flags & RING_F_STATIC) {
+        /* not a power of two */
+        return NULL;
+    }
+
+	/* attempt to get some memory for this ringbuffer */
+	ring = malloc(sizeof(RING_T));
+	if (!ring) {
+		/* we failed, return NULL and hope calling code can deal with this */
+		return NULL;
+	}
+
+	/* init the metadata, first the pointers */
+	ring->head = 0;
+	ring->tail = 0;
+	ring->mask = len-1; /* since this is a power of two, 1 less is the mask */
+	ring->flags = flags;
+	ring->dropped = 0;
+	ring->peak = 0;
+	ring->high_fn = NULL;
+	ring->low_fn = NULL;
+	/* now attempt to malloc the space */
+	ring->buf = malloc(len);
+	if (!ring->buf) {
+		free(ring); /* failed! free what we have created so far, give up */
+		return NULL;
+	}
+
+	return ring;
+}
+
+/* set up a ringbuffer over storage someone else owns */
+int RING_FN(init_static)(RING_T *ring, char *buf, uint16_t len,
+	uint8_t flags) {
+	/* same rules as create, but we can't be given nothing */
+	if (!ring || !buf || len < 2 || len > RING_MAX || len & (len-1)) {
+		return -EINVAL;
+	}
+
+	ring->buf = buf;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->mask = len-1;
+	ring->flags = flags | RING_F_STATIC; /* never free() this */
+	ring->dropped = 0;
+	ring->peak = 0;
+	ring->high_fn = NULL;
+	ring->low_fn = NULL;
+
+	return 0;
+}
+
+/* reset the contents of a ringbuffer */
+void RING_FN(reset)(RING_T *ring) {
+	ring->head = 0;
+	ring->tail = 0;
+	return;
+}
+
+void RING_FN(destroy)(RING_T *ring) {
+	/* let's not just attempt to free something unallocated */
+	if (!ring || (ring->flags & RING_F_STATIC)) {
+		return;
+	}
+	/* free the buffer associated with us */
+	if (ring->buf) {
+		free(ring->buf);
+	}
+	/* and our struct */
+	free(ring);
+	return;
+}
+
+/* stop gcc moving buffer accesses across an index update */
+#define _ring_barrier() __asm__ __volatile__ ("" ::: "memory")
+
+/* load an index which may be stored by the other side of the ring */
+static inline RING_IDX_T _ring_load_idx(RING_IDX_T *idx) {
+#ifdef RING_WIDE
+	RING_IDX_T ret;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ret = *(volatile RING_IDX_T *)idx;
+	}
+	return ret;
+#else
+	return *(volatile RING_IDX_T *)idx;
+#endif // RING_WIDE
+}
+
+/* publish an index, after everything it covers has been stored/loaded */
+static inline void _ring_store_idx(RING_IDX_T *idx, RING_IDX_T value) {
+	_ring_barrier();
+#ifdef RING_WIDE
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		*(volatile RING_IDX_T *)idx = value;
+	}
+#else
+	*(volatile RING_IDX_T *)idx = value;
+#endif // RING_WIDE
+}
+
+/* producer side bookkeeping, after the fill level grew by len characters
+ * to used. len counts what was written less any old characters overwritten
+ * to make room, so a full ring in RING_F_OVERWRITE mode grows by 0 */
+static inline void _ring_produced(RING_T *ring, RING_IDX_T used,
+	uint16_t len) {
+	if (used > ring->peak) {
+		ring->peak = used;
+	}
+	/* only fire on the write which crosses the line */
+	if (ring->high_fn && used >= ring->wm_high &&
+		(int16_t)(used - len) < (int16_t)ring->wm_high) {
+		(*ring->high_fn)(ring);
+	}
+}
+
+/* consumer side bookkeeping, after len characters were consumed and the
+ * ring now holds used characters */
+static inline void _ring_consumed(RING_T *ring, RING_IDX_T used,
+	uint16_t len) {
+	if (ring->low_fn && used <= ring->wm_low &&
+		(uint16_t)(used + len) > ring->wm_low) {
+		(*ring->low_fn)(ring);
+	}
+}
+
+/* write to the given ring buffer, producer side of SPSC */
+uint8_t RING_FN(write)(RING_T *ring, char value) {
+	RING_IDX_T next, tail;
+	uint8_t grew = 1;
+
+	next = (ring->head + 1) & ring->mask;
+	tail = _ring_load_idx(&ring->tail);
+	if (next == tail) {
+		/* full, lose either this character or the oldest one */
+		ring->dropped++;
+		if (!(ring->flags & RING_F_OVERWRITE)) {
+			return 0;
+		}
+		tail = (tail + 1) & ring->mask;
+		_ring_store_idx(&ring->tail, tail);
+		grew = 0;
+	}
+	*(ring->buf + next) = value;
+	_ring_store_idx(&ring->head, next);
+	_ring_produced(ring, (next - tail) & ring->mask, grew);
+
+	return 1;
+}
+
+uint8_t RING_FN(write_unsafe)(RING_T *ring, char s) {
+	RING_IDX_T next;
+	uint8_t grew = 1;
+
+	next = (ring->head + 1) & ring->mask;
+	if (next == ring->tail) {
+		/* full, lose either this character or the oldest one */
+		ring->dropped++;
+		if (!(ring->flags & RING_F_OVERWRITE)) {
+			return 0;
+		}
+		ring->tail = (ring->tail + 1) & ring->mask;
+		grew = 0;
+	}
+	*(ring->buf + next) = s;
+	ring->head = next;
+	_ring_produced(ring, (next - ring->tail) & ring->mask, grew);
+	return 1;
+}
+
+/* read from the given ring buffer, consumer side of SPSC */
+char RING_FN(read)(RING_T *ring) {
+	char ret;
+	RING_IDX_T next;
+
+	next = (ring->tail + 1) & ring->mask;
+	_ring_barrier(); /* don't hoist the load above the caller's readable check */
+	ret = *(ring->buf + next);
+	_ring_store_idx(&ring->tail, next);
+	if (ring->low_fn) {
+		_ring_consumed(ring, (_ring_load_idx(&ring->head) - next) & ring->mask, 1);
+	}
+	return ret;
+}
+
+char RING_FN(read_unsafe)(RING_T *ring) {
+	ring->tail = (ring->tail + 1) & ring->mask;
+	_ring_consumed(ring, (ring->head - ring->tail) & ring->mask, 1);
+	return *(ring->buf + ring->tail);
+}
+
+/* block functions are built on peek/commit, which already follow the SPSC
+ * rules, so there is no difference between the safe and unsafe versions */
+uint16_t RING_FN(write_block)(RING_T *ring, const char *buf, uint16_t len) {
+	return RING_FN(write_block_unsafe)(ring, buf, len);
+}
+
+uint16_t RING_FN(write_block_unsafe)(RING_T *ring, const char *buf, uint16_t len) {
+	uint16_t done = 0, n, space, skip = 0, lost = 0;
+	char *ptr;
+
+	if (ring->flags & RING_F_OVERWRITE) {
+		/* only the newest characters can possibly fit, skip the rest */
+		if (len > ring->mask) {
+			skip = len - ring->mask;
+			ring->dropped += skip;
+			done = skip;
+		}
+		/* discard the oldest to make room for what is left */
+		space = ring->mask - ((ring->head - ring->tail) & ring->mask);
+		if (len - done > space) {
+			lost = len - done - space;
+			ring->dropped += lost;
+			_ring_store_idx(&ring->tail, (ring->tail + lost) & ring->mask);
+		}
+	}
+
+	/* normally two passes at most, one either side of the wrap point */
+	while (done < len) {
+		n = RING_FN(peek_write)(ring, &ptr);
+		if (!n) {
+			break; /* full, the caller still has the rest */
+		}
+		if (n > len - done) {
+			n = len - done;
+		}
+		memcpy(ptr, buf + done, n);
+		_ring_store_idx(&ring->head, (ring->head + n) & ring->mask);
+		done += n;
+	}
+	/* once for the whole block, the overwritten characters made room for
+	 * it rather than emptying the ring */
+	_ring_produced(ring, (ring->head - _ring_load_idx(&ring->tail)) & ring->mask,
+		done - skip - lost);
+	return done;
+}
+
+uint16_t RING_FN(read_block)(RING_T *ring, char *buf, uint16_t len) {
+	return RING_FN(read_block_unsafe)(ring, buf, len);
+}
+
+uint16_t RING_FN(read_block_unsafe)(RING_T *ring, char *buf, uint16_t len) {
+	uint16_t done = 0, n;
+	char *ptr;
+
+	/* normally two passes at most, one either side of the wrap point */
+	while (done < len) {
+		n = RING_FN(peek_read)(ring, &ptr);
+		if (!n) {
+			break; /* empty */
+		}
+		if (n > len - done) {
+			n = len - done;
+		}
+		memcpy(buf + done, ptr, n);
+		RING_FN(commit_read)(ring, n);
+		done += n;
+	}
+	return done;
+}
+
+/* readable region starts one past the tail, and runs to the head or the
+ * end of the buffer, whichever comes first */
+uint16_t RING_FN(peek_read)(RING_T *ring, char **ptr) {
+	uint16_t start, used, n;
+
+	start = (ring->tail + 1) & ring->mask;
+	used = (_ring_load_idx(&ring->head) - ring->tail) & ring->mask;
+	_ring_barrier(); /* caller's loads from the region must come after this */
+	n = (ring->mask + 1) - start;
+	if (n > used) {
+		n = used;
+	}
+	*ptr = ring->buf + start;
+	return n;
+}
+
+void RING_FN(commit_read)(RING_T *ring, uint16_t len) {
+	RING_IDX_T tail;
+
+	tail = (ring->tail + len) & ring->mask;
+	_ring_store_idx(&ring->tail, tail);
+	if (ring->low_fn) {
+		_ring_consumed(ring, (_ring_load_idx(&ring->head) - tail) & ring->mask, len);
+	}
+}
+
+/* writable region starts one past the head, and runs to one short of the
+ * tail or the end of the buffer, whichever comes first */
+uint16_t RING_FN(peek_write)(RING_T *ring, char **ptr) {
+	uint16_t start, space, n;
+
+	start = (ring->head + 1) & ring->mask;
+	space = ring->mask - ((ring->head - _ring_load_idx(&ring->tail)) & ring->mask);
+	_ring_barrier(); /* caller's stores to the region must come after this */
+	n = (ring->mask + 1) - start;
+	if (n > space) {
+		n = space;
+	}
+	*ptr = ring->buf + start;
+	return n;
+}
+
+void RING_FN(commit_write)(RING_T *ring, uint16_t len) {
+	RING_IDX_T head;
+
+	head = (ring->head + len) & ring->mask;
+	_ring_store_idx(&ring->head, head);
+	_ring_produced(ring, (head - _ring_load_idx(&ring->tail)) & ring->mask, len);
+}
+
+/* safe to call from either side */
+uint8_t RING_FN(readable)(RING_T *ring) {
+	if (_ring_load_idx(&ring->tail) != _ring_load_idx(&ring->head)) {
+		return 1;
+	}
+	return 0;
+}
+
+uint8_t RING_FN(readable_unsafe)(RING_T *ring) {
+	if (ring->tail != ring->head) {
+		return 1;
+	}
+	return 0;
+}
+
+uint16_t RING_FN(used)(RING_T *ring) {
+	return (_ring_load_idx(&ring->head) - _ring_load_idx(&ring->tail)) & ring->mask;
+}
+
+uint16_t RING_FN(free)(RING_T *ring) {
+	return ring->mask - RING_FN(used)(ring);
+}
+
+int RING_FN(watermark)(RING_T *ring, uint16_t high,
+	void (*high_fn)(RING_T *), uint16_t low,
+	void (*low_fn)(RING_T *)) {
+	/* the thresholds are stored as indexes, so must fit in one */
+	if (high > ring->mask || low > ring->mask ||
+		(high_fn && low_fn && low > high)) {
+		return -EINVAL;
+	}
+	ring->wm_high = high;
+	ring->wm_low = low;
+	ring->high_fn = high_fn;
+	ring->low_fn = low_fn;
+	return 0;
+}
+
+uint16_t RING_FN(peak)(RING_T *ring) {
+	return ring->peak;
+}
+
+void RING_FN(peak_reset)(RING_T *ring) {
+	ring->peak = 0;
+}
+
+uint16_t RING_FN(dropped)(RING_T *ring) {
+	return ring->dropped;
+}
+
+void RING_FN(dropped_reset)(RING_T *ring) {
+	ring->dropped = 0;
+}
@@ -37,25 +37,78 @@ extern "C" {
  *
  *  Functions come in normal and 'unsafe' version. In the unsafe versions you
  *  must ensure that no concurrent access to a single ringbuffer is possible.
- *  The normal (safe) versions implement this with global interrupt disable,
- *  which is blunt but effective.
+ *  The normal (safe) versions are lock-free and need no interrupt disable,
+ *  provided there is only one producer (writer) and one consumer (reader)
+ *  of each ringbuffer. The producer and consumer may be in different
+ *  contexts, eg main loop and ISR. The protocol is described in
+ *  ring_impl.h, which ringbuffer.c and ring16.c share.
  *
- *  Note: the current limit for the size of a ringbuffer is 256 bytes.
+ *  Ringbuffer indexes are 8 bits wide, which limits the size of a
+ *  ringbuffer to 256 bytes. For larger ringbuffers see ring16.h, which has
+ *  the same interface with 16 bit indexes. Each ringbuffer can use
+ *  whichever suits it, so small ones keep the faster 8 bit version.
  */
 
+/** \brief Ringbuffer index type */
+typedef uint8_t ring_idx_t;
 /* maximum size of a ringbuffer */
 #define RINGBUFFER_MAX 256
 
 /** \struct ringbuffer_t
  *  \brief Buffer and metadata for a ringbuffer
  */
-typedef struct {
+typedef struct ringbuffer_s {
 		char *buf;      /**< The actual ringbuffer storage */
-		uint8_t head;   /**< Head pointer */
-		uint8_t tail;   /**< Tail pointer */
-		uint8_t mask;   /**< Mask to wrap ringbuffer */
+		ring_idx_t head;   /**< Head pointer */
+		ring_idx_t tail;   /**< Tail pointer */
+		ring_idx_t mask;   /**< Mask to wrap ringbuffer */
+		uint8_t flags;  /**< Ringbuffer flags, see RING_F_ */
+		uint16_t dropped; /**< Characters lost to a full ringbuffer */
+		ring_idx_t peak;   /**< Most characters ever held, producer owned */
+		ring_idx_t wm_high; /**< High watermark, see ring_watermark() */
+		ring_idx_t wm_low;  /**< Low watermark, see ring_watermark() */
+		void (*high_fn)(struct ringbuffer_s *); /**< High watermark hook */
+		void (*low_fn)(struct ringbuffer_s *);  /**< Low watermark hook */
 } ringbuffer_t;
 
+#define RING_F_NONE 0 /**< Ringbuffer flag: None */
+#define RING_F_STATIC 1 /**< Ringbuffer flag: storage not from malloc() */
+#define RING_F_OVERWRITE 2 /**< Ringbuffer flag: overwrite oldest when full */
+
+/** \brief Define a ringbuffer with static storage
+ *
+ *  Creates a ringbuffer_t called name, and a buffer of size bytes called
+ *  name_buf, both zeroed in .bss so they show up in avr-size output. The
+ *  size is checked at compile time, a size which is not a power of two or
+ *  larger than RINGBUFFER_MAX fails with a negative array size error
+ *  mentioning name_size_check.
+ *
+ *  The ringbuffer must be set up with RING_INIT() before use.
+ *
+ *  \param name Name of the ringbuffer
+ *  \param size Size of the ringbuffer in bytes, a power of two
+ */
+#define RING_DEFINE(name, size) \
+	typedef char name##_size_check[((size) > 1 && (size) <= RINGBUFFER_MAX && \
+		!((size) & ((size) - 1))) ? 1 : -1]; \
+	char name##_buf[(size)]; \
+	ringbuffer_t name
+
+/** \brief Initialise a ringbuffer defined with RING_DEFINE()
+ *  \param name Name of the ringbuffer
+ *  \return 0 on success, errors.h otherwise
+ */
+#define RING_INIT(name) \
+	ring_init_static(&name, name##_buf, sizeof(name##_buf), RING_F_NONE)
+
+/** \brief Initialise a ringbuffer defined with RING_DEFINE(), with flags
+ *  \param name Name of the ringbuffer
+ *  \param flags Mode flags, see ring_create_flags()
+ *  \return 0 on success, errors.h otherwise
+ */
+#define RING_INIT_FLAGS(name, flags) \
+	ring_init_static(&name, name##_buf, sizeof(name##_buf), (flags))
+
 /** \brief Create a ringbuffer of the given mask
  *  \param len The length of the ringbuffer. This must be a power of two.
  *  \return Pointer to the created ringbuffer, NULL if is failed to allocate memory
@@ -63,6 +116,41 @@ typedef struct {
  */
 ringbuffer_t *ring_create(uint16_t len);
 
+/** \brief Create a ringbuffer of the given mask, with mode flags
+ *
+ *  Flags may be RING_F_NONE, or RING_F_OVERWRITE. Normally writing to a
+ *  full ringbuffer drops the new character. With RING_F_OVERWRITE the
+ *  oldest unread character is discarded to make room instead, so the
+ *  ringbuffer always holds the most recent writes. This suits trace and
+ *  log buffers which are dumped after something goes wrong.
+ *
+ *  Note: an overwriting producer moves the tail, so these ringbuffers are
+ *  not lock-free SPSC. Read them with the producer stopped, or with
+ *  interrupts disabled if the producer is an ISR. Writes through
+ *  ring_peek_write() never overwrite.
+ *
+ *  \param len The length of the ringbuffer. This must be a power of two.
+ *  \param flags Mode flags
+ *  \return Pointer to the created ringbuffer, NULL if is failed to allocate memory
+ *  or some other error.
+ */
+ringbuffer_t *ring_create_flags(uint16_t len, uint8_t flags);
+
+/** \brief Initialise a ringbuffer over caller provided storage
+ *
+ *  No memory is allocated, the ringbuffer adopts the storage passed in.
+ *  ring_destroy() will not attempt to free it. See RING_DEFINE() for a
+ *  convenient way to create the storage.
+ *
+ *  \param ring The ringbuffer metadata to initialise
+ *  \param buf Storage for the ringbuffer contents
+ *  \param len The length of buf. This must be a power of two.
+ *  \param flags Mode flags, see ring_create_flags()
+ *  \return 0 on success, errors.h otherwise
+ */
+int ring_init_static(ringbuffer_t *ring, char *buf, uint16_t len,
+	uint8_t flags);
+
 /** \brief Reset (aka flush) the contents of a ringbuffer
  *  \param ring The ringbuffer to flush
  */
@@ -71,6 +159,7 @@ void ring_reset(ringbuffer_t *ring);
 /** \brief Destroy a ringbuffer
  *
  *  Frees all resources allocated by it, including the metadata about the ring.
+ *  Ringbuffers set up by ring_init_static() are left alone.
  *
  *  Note: use sparingly, free() may be a null call on your platform!
  *
@@ -80,8 +169,9 @@ void ring_destroy(ringbuffer_t *ring);
 
 /** \brief Write a character to the ringbuffer
  *
- *  Note: this disables global interrupts. You may wish to use the unsafe
- *  versions instead, and selectively disable interrupts.
+ *  Note: safe for one producer and one consumer without disabling
+ *  interrupts. Multiple producers or consumers must be serialised by
+ *  the caller.
  *
  *  \param ring Ringbuffer to write to
  *  \param value Character to write
@@ -101,8 +191,9 @@ uint8_t ring_write_unsafe(ringbuffer_t *ring, char value);
  *
  *  You should check it's readable with ring_readable() first or you will get odd results.
  *
- *  Note: this disables global interrupts. You may wish to use the unsafe
- *  versions instead, and selectively disable interrupts.
+ *  Note: safe for one producer and one consumer without disabling
+ *  interrupts. Multiple producers or consumers must be serialised by
+ *  the caller.
  *
  *  \param ring Ringbuffer to read
  *  \return Character from the ringbuffer (could be 0)
@@ -117,10 +208,111 @@ char ring_read(ringbuffer_t *ring);
  */
 char ring_read_unsafe(ringbuffer_t *ring);
 
+/** \brief Write a block of characters to the ringbuffer
+ *
+ *  Copies as much of the block as will fit, in at most two segments
+ *  either side of the wrap point.
+ *
+ *  Note: safe for one producer and one consumer without disabling
+ *  interrupts. Multiple producers or consumers must be serialised by
+ *  the caller.
+ *
+ *  \param ring Ringbuffer to write to
+ *  \param buf Characters to write
+ *  \param len Number of characters in buf
+ *  With RING_F_OVERWRITE the whole block is written, discarding the
+ *  oldest characters as needed. Otherwise characters which did not fit
+ *  are left with the caller to retry, so are not counted by
+ *  ring_dropped().
+ *
+ *  \return Number of characters written, may be less than len if the
+ *  ringbuffer filled
+ */
+uint16_t ring_write_block(ringbuffer_t *ring, const char *buf, uint16_t len);
+
+/** \brief Write a block of characters to the ringbuffer (unsafe version)
+ *
+ *  This does not perform any interrupt disabling.
+ *
+ *  Same as ring_write_block()
+ */
+uint16_t ring_write_block_unsafe(ringbuffer_t *ring, const char *buf, uint16_t len);
+
+/** \brief Read a block of characters from the ringbuffer
+ *
+ *  Copies as many characters as are available, up to len, in at most
+ *  two segments either side of the wrap point.
+ *
+ *  Note: safe for one producer and one consumer without disabling
+ *  interrupts. Multiple producers or consumers must be serialised by
+ *  the caller.
+ *
+ *  \param ring Ringbuffer to read
+ *  \param buf Where to put the characters read
+ *  \param len Maximum number of characters to read
+ *  \return Number of characters read, 0 if the ringbuffer was empty
+ */
+uint16_t ring_read_block(ringbuffer_t *ring, char *buf, uint16_t len);
+
+/** \brief Read a block of characters from the ringbuffer (unsafe version)
+ *
+ *  This does not perform any interrupt disabling.
+ *
+ *  Same as ring_read_block()
+ */
+uint16_t ring_read_block_unsafe(ringbuffer_t *ring, char *buf, uint16_t len);
+
+/** \brief Find the contiguous region of the ringbuffer ready to be read
+ *
+ *  This allows the contents to be consumed in place, without copying.
+ *  The region stops at the wrap point, so a full drain may need two
+ *  peek/commit rounds. Nothing is consumed until ring_commit_read() is
+ *  called.
+ *
+ *  The same producer/consumer rules as the safe versions apply.
+ *
+ *  \param ring Ringbuffer to read
+ *  \param ptr Set to the start of the readable region
+ *  \return Number of contiguous characters readable at ptr, 0 if empty
+ */
+uint16_t ring_peek_read(ringbuffer_t *ring, char **ptr);
+
+/** \brief Consume characters previously found with ring_peek_read()
+ *
+ *  \param ring Ringbuffer to read
+ *  \param len Number of characters consumed, must not be more than the
+ *  last ring_peek_read() returned
+ */
+void ring_commit_read(ringbuffer_t *ring, uint16_t len);
+
+/** \brief Find the contiguous region of the ringbuffer free to be written
+ *
+ *  This allows the ringbuffer to be filled in place, without copying.
+ *  The region stops at the wrap point, so filling it completely may need
+ *  two peek/commit rounds. Nothing is visible to the reader until
+ *  ring_commit_write() is called.
+ *
+ *  The same producer/consumer rules as the safe versions apply.
+ *
+ *  \param ring Ringbuffer to write to
+ *  \param ptr Set to the start of the writable region
+ *  \return Number of contiguous characters writable at ptr, 0 if full
+ */
+uint16_t ring_peek_write(ringbuffer_t *ring, char **ptr);
+
+/** \brief Publish characters written into the region from ring_peek_write()
+ *
+ *  \param ring Ringbuffer to write to
+ *  \param len Number of characters written, must not be more than the
+ *  last ring_peek_write() returned
+ */
+void ring_commit_write(ringbuffer_t *ring, uint16_t len);
+
 /** \brief Check to see if we have anything to read
  *
- *  Note: this disables global interrupts. You may wish to use the unsafe
- *  version instead, and selectively disable interrupts.
+ *  Note: safe for one producer and one consumer without disabling
+ *  interrupts. Multiple producers or consumers must be serialised by
+ *  the caller.
  *
  *  \param ring The ringbuffer to check
  *  \return 1 for characters still to read, 0 otherwise
@@ -135,6 +327,83 @@ uint8_t ring_readable(ringbuffer_t *ring);
  */
 uint8_t ring_readable_unsafe(ringbuffer_t *ring);
 
+/** \brief Number of characters waiting to be read
+ *
+ *  Safe to call from either the producer or the consumer.
+ *
+ *  \param ring The ringbuffer to check
+ *  \return Number of characters in the ringbuffer
+ */
+uint16_t ring_used(ringbuffer_t *ring);
+
+/** \brief Number of characters which can be written before it is full
+ *
+ *  Safe to call from either the producer or the consumer.
+ *
+ *  \param ring The ringbuffer to check
+ *  \return Number of characters of free space in the ringbuffer
+ */
+uint16_t ring_free(ringbuffer_t *ring);
+
+/** \brief Set watermark hooks on the ringbuffer
+ *
+ *  high_fn is called by the producer when a write takes the number of
+ *  characters in the ringbuffer from below high to high or more. low_fn
+ *  is called by the consumer when a read takes it from above low to low
+ *  or less. Hooks run in the context of whoever did the write or read,
+ *  which may be an ISR, so keep them short.
+ *
+ *  In RING_F_OVERWRITE mode a write to a full ringbuffer leaves the
+ *  fill level where it was, so does not call high_fn again.
+ *
+ *  Either hook may be NULL if not required. Set the hooks before the
+ *  ringbuffer is in use.
+ *
+ *  \param ring The ringbuffer to hook
+ *  \param high High watermark, in characters
+ *  \param high_fn Function to invoke when the high watermark is reached
+ *  \param low Low watermark, in characters
+ *  \param low_fn Function to invoke when the low watermark is reached
+ *  \return 0 for success, -EINVAL if a watermark is more than the
+ *  ringbuffer holds or, with both hooks, low is above high
+ */
+int ring_watermark(ringbuffer_t *ring, uint16_t high,
+	void (*high_fn)(ringbuffer_t *), uint16_t low,
+	void (*low_fn)(ringbuffer_t *));
+
+/** \brief Highest number of characters the ringbuffer has held
+ *
+ *  Useful to right-size ringbuffers from real world use. This survives
+ *  ring_reset(), use ring_peak_reset() to clear it.
+ *
+ *  \param ring The ringbuffer to check
+ *  \return Peak number of characters held
+ */
+uint16_t ring_peak(ringbuffer_t *ring);
+
+/** \brief Clear the peak occupancy of the ringbuffer
+ *  \param ring The ringbuffer to clear
+ */
+void ring_peak_reset(ringbuffer_t *ring);
+
+/** \brief Number of characters lost because the ringbuffer was full
+ *
+ *  Normally this counts ring_write() characters which were dropped, a
+ *  short ring_write_block() is not a loss. With RING_F_OVERWRITE it
+ *  counts old characters which were overwritten, or skipped over by a
+ *  block too large to fit. The count wraps at
+ *  65536 and survives ring_reset(), use ring_dropped_reset() to clear it.
+ *
+ *  \param ring The ringbuffer to check
+ *  \return Number of characters lost
+ */
+uint16_t ring_dropped(ringbuffer_t *ring);
+
+/** \brief Clear the count of characters lost
+ *  \param ring The ringbuffer to clear
+ */
+void ring_dropped_reset(ringbuffer_t *ring);
+
 #ifdef __cplusplus
 }
 #endif
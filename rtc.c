@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include "global.h"
 #include "rtc.h"
+#include "sleep.h"
 #include "errors.h"
 
 /* pointers to the compare/ovf hooks */
@@ -56,6 +57,12 @@ int rtc_div(rtc_clk_div_t div) {
     if (div > rtc_div1024) {
         return -EINVAL;
     }
+    /* the RTC keeps running in power-save, but not power-down */
+    if (div && !(RTC.CTRL & RTC_PRESCALER_gm)) {
+        sleep_hold(sleep_psave);
+    } else if (!div && (RTC.CTRL & RTC_PRESCALER_gm)) {
+        sleep_release(sleep_psave);
+    }
     RTC.CTRL = div; /* runs it if non-zero */
     /* wait until sync is done */
     while (RTC.STATUS & RTC_SYNCBUSY_bm);
@@ -59,7 +59,8 @@ int rtc_init(uint16_t period, void (*cmp_hook)(void), void (*ovf_hook)(void));
 /** \brief Clock the RTC at the given divisor.
  *
  *  This sets the RTC divider from its clock source. rtc_off stops the
- *  RTC.
+ *  RTC. While running, the RTC prevents sleep_enter() from going deeper
+ *  than sleep_psave.
  *
  *  Note: Before calling this function, you should ensure that the clock
  *  source has been configured where appropriate, using clock_xosc() and
@@ -0,0 +1,229 @@
+#ifndef SCHED_CO_H_INCLUDED
+#define SCHED_CO_H_INCLUDED
+
+/* Copyright (C) 2015 David Zanetti
+ *
+ * This file is part of libkakapo
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <util/atomic.h>
+#include "errors.h"
+#include "sched_simple.h"
+
+/** \file
+ *  \brief Stackless coroutine tasks for sched_simple
+ *
+ *  These macros let a task be written as straight line code which waits
+ *  for things to happen, rather than as a hand written state machine.
+ *  Waiting saves the point to resume from in the coroutine context and
+ *  returns to the scheduler, so no task needs a stack of its own.
+ *
+ *  A coroutine is a task function of the form:
+ *
+ *      void my_task(void *data) {
+ *          my_state_t *s = data;
+ *
+ *          SCHED_CO_BEGIN(&s->co);
+ *          while (1) {
+ *              SCHED_CO_WAIT_RING(&s->co, ring_used, rx);
+ *              ... read from rx ...
+ *              SCHED_CO_WAIT_TICKS(&s->co, 100);
+ *          }
+ *          SCHED_CO_END(&s->co);
+ *      }
+ *
+ *  where my_state_t starts with a sched_co_t called co, and is set up
+ *  with sched_co_init(&s->co, &my_task, prio) and started with
+ *  sched_co_wake(&s->co). The task is given its context as data.
+ *
+ *  The usual protothread rules apply, since the macros hide a switch
+ *  statement. Local variables are not kept across a wait, so keep state
+ *  in the context. A wait may not be placed inside a switch statement of
+ *  your own. Only the coroutine's own function may wait on its context.
+ *
+ *  Wakeups are coalesced as for registered tasks, and the wait macros
+ *  check their condition again when resumed, so waking a coroutine too
+ *  often is harmless. A coroutine keeps the timer it armed for one wait
+ *  for the next, as long as it goes off soon enough, so waits which end
+ *  early don't use up timers. A timer left over from an earlier wait only
+ *  makes the current one check its condition again, it never satisfies
+ *  SCHED_CO_WAIT_EVENT(), which needs a sched_co_wake().
+ */
+
+/** \brief Coroutine context */
+typedef struct {
+    sched_task_t task; /**< Registered task which runs the coroutine */
+    uint16_t lc; /**< Line to resume from, 0 to start at the top */
+    uint16_t until; /**< Tick to resume at, for SCHED_CO_WAIT_TICKS */
+    sched_handle_t timer; /**< Last timer armed, negative if none */
+    uint16_t timer_at; /**< Tick the last timer goes off at */
+    volatile uint8_t woken; /**< Set by sched_co_wake(), for WAIT_EVENT */
+} sched_co_t;
+
+/** \brief Set up a coroutine context
+ *
+ *  \param co Context to set up, must stay valid while the coroutine runs
+ *  \param fn Coroutine function, which is passed co as data
+ *  \param prio Priority to run the coroutine at
+ *  \return 0 on success, errors.h otherwise
+ */
+static inline int sched_co_init(sched_co_t *co, void (*fn)(void *),
+    sched_prio_t prio) {
+    if (!co) {
+        return -EINVAL;
+    }
+    co->lc = 0;
+    co->timer = -1;
+    co->woken = 0;
+    return sched_task_init(&co->task, fn, co, prio);
+}
+
+/** \brief Start or resume a coroutine, may be called from interrupts
+ *
+ *  \param co Coroutine context
+ *  \return 0 on success, -ENOMEM if the run queue is full
+ */
+static inline int sched_co_wake(sched_co_t *co) {
+    co->woken = 1;
+    return sched_task_run(&co->task);
+}
+
+/* take the wakeups since the last run, so a wake while the coroutine is
+ * running is seen by the next run */
+static inline uint8_t _sched_co_woken(sched_co_t *co) {
+    uint8_t woken;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        woken = co->woken;
+        co->woken = 0;
+    }
+    return woken;
+}
+
+/* is the last timer still to go off? Once it has, the task is queued */
+static inline uint8_t _sched_co_armed(sched_co_t *co, uint16_t now) {
+    return (co->timer >= 0 && (int16_t)(co->timer_at - now) > 0);
+}
+
+/* be run again in ticks, or sooner. The last timer is kept if it goes off
+ * in time, otherwise it is replaced. Polls on the next pass of the
+ * scheduler if no timer is free */
+static inline void _sched_co_timer(sched_co_t *co, uint16_t ticks) {
+    uint16_t now = sched_ticks();
+
+    if (_sched_co_armed(co, now)) {
+        if ((int16_t)(co->timer_at - (now + ticks)) <= 0) {
+            return;
+        }
+        sched_timer_cancel(co->timer);
+    }
+    co->timer = -1;
+    /* a tick may have gone by since the caller looked */
+    if (ticks) {
+        co->timer = sched_task_run_after(&co->task, ticks);
+        co->timer_at = now + ticks;
+    }
+    if (co->timer < 0) {
+        sched_task_run(&co->task);
+    }
+}
+
+/* the coroutine has finished, so nothing may restart it but a wake */
+static inline void _sched_co_timer_stop(sched_co_t *co) {
+    if (_sched_co_armed(co, sched_ticks())) {
+        sched_timer_cancel(co->timer);
+    }
+    co->timer = -1;
+}
+
+/** \brief Start of the coroutine body */
+#define SCHED_CO_BEGIN(co) \
+    uint8_t _co_woken = _sched_co_woken(co); \
+    (void)_co_woken; \
+    switch ((co)->lc) { case 0:
+
+/** \brief End of the coroutine body, the next wake starts again at the
+ *  top */
+#define SCHED_CO_END(co) } _sched_co_timer_stop(co); (co)->lc = 0; return
+
+/** \brief Let other tasks run, then carry on */
+#define SCHED_CO_YIELD(co) do { \
+    (co)->lc = __LINE__; \
+    sched_task_run(&(co)->task); \
+    return; \
+    case __LINE__:; \
+} while (0)
+
+/** \brief Wait for the next sched_co_wake()
+ *
+ *  A wake which arrives while the coroutine is running, before it gets
+ *  here, counts as the next one.
+ */
+#define SCHED_CO_WAIT_EVENT(co) do { \
+    (co)->lc = __LINE__; \
+    return; \
+    case __LINE__: \
+    if (!_co_woken) { \
+        return; \
+    } \
+    _co_woken = 0; \
+} while (0)
+
+/** \brief Wait until cond is true, checking it on every sched_co_wake() */
+#define SCHED_CO_WAIT_UNTIL(co, cond) do { \
+    (co)->lc = __LINE__; \
+    case __LINE__: \
+    if (!(cond)) { \
+        return; \
+    } \
+} while (0)
+
+/** \brief Wait for the given number of scheduler ticks
+ *
+ *  If no timer is free, the coroutine yields until the time is up.
+ */
+#define SCHED_CO_WAIT_TICKS(co, ticks) do { \
+    (co)->until = sched_ticks() + (ticks); \
+    (co)->lc = __LINE__; \
+    case __LINE__: \
+    if ((int16_t)(sched_ticks() - (co)->until) < 0) { \
+        _sched_co_timer(co, (co)->until - sched_ticks()); \
+        return; \
+    } \
+} while (0)
+
+/** \brief Wait until there is something to read in a ringbuffer
+ *
+ *  The ring is checked every tick, so the producer need not know about
+ *  the coroutine, but calling sched_co_wake() from the producer, eg the
+ *  receive hook of usart_conf(), resumes it without that delay.
+ *
+ *  used is the fill level function for the type of ring, eg ring_used,
+ *  ring16_used, or USART_RING(used) for a USART ring.
+ */
+#define SCHED_CO_WAIT_RING(co, used, ring) do { \
+    (co)->lc = __LINE__; \
+    case __LINE__: \
+    if (!used(ring)) { \
+        _sched_co_timer(co, 1); \
+        return; \
+    } \
+} while (0)
+
+#endif // SCHED_CO_H_INCLUDED
@@ -45,12 +45,28 @@
  *
  * A task cannot be destroyed. A task may call itself to be run again.
  *
- * sched_run() accepts two priorities, sched_later which places the task
- * at the end of the run queue, and sched_now which placed it at the top.
- * There are no other priority levels.
+ * sched_run() accepts one of SCHED_LEVELS priority levels. Each level is
+ * a FIFO, and the dispatcher always runs the oldest task from the highest
+ * level with anything waiting. sched_now is the highest level, and
+ * sched_later is the lowest.
+ */
+
+/* The run queue is a pool of qlen task slots. Free slots are kept on a
+ * free list, and each priority level is a singly linked FIFO of slots,
+ * so a slot never moves between being queued and being run. A bitmap has
+ * bit n set while level n has tasks waiting, and the lowest set bit (ie,
+ * the highest priority level) is found with a nibble lookup table.
+ */
+
+/* Only the main context touches the run queue. Tasks added from an
+ * interrupt are copied into a queue.h queue for the PMIC level executing
+ * instead. An ISR can only be interrupted by a higher level, so each of
+ * these has one producer, and the dispatcher as its one consumer, so no
+ * locking is needed on either side.
  */
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include "global.h"
 #include <stdio.h>
 #include <avr/pgmspace.h>
@@ -59,28 +75,160 @@
 #include <util/atomic.h>
 #include "errors.h"
 #include "debug.h"
+#include "sleep.h"
+#include "queue.h"
 
 #include "sched_simple.h"
 
+/* marks the end of a list of slots */
+#define _RUNQ_NONE 0xff
+
+#if (SCHED_INGRESS & (SCHED_INGRESS - 1)) || (SCHED_INGRESS < 2) || (SCHED_INGRESS > QUEUE_MAX)
+#error "SCHED_INGRESS must be a power of two, from 2 to QUEUE_MAX"
+#endif
+
+/* what a task is given when it runs */
+typedef union {
+    void *data; /**< Private data for this task to use */
+    uint8_t payload[SCHED_PAYLOAD]; /**< Copy given to sched_post() */
+} task_arg_t;
+
 /* what a task consists of in the queue */
 typedef struct {
     void (*fn)(void *); /**< Pointer to the actual task entry point */
-    void *data; /**< Private data for this task to use */
+    task_arg_t arg; /**< Data pointer or payload */
+    uint8_t post; /**< Set if the task is passed the payload */
+    uint8_t next; /**< Next slot in the same list, or _RUNQ_NONE */
+    uint16_t gen; /**< Generation of this slot, for handles to it */
+    sched_handle_t handle; /**< Handle given out for this task */
+#ifdef SCHED_PROFILE
+    uint16_t queued; /**< Profiling clock when added to the run queue */
+#endif
 } task_t;
 
+/* what a task consists of on its way in to the queue */
+typedef struct {
+    void (*fn)(void *); /**< Pointer to the actual task entry point */
+    task_arg_t arg; /**< Data pointer or payload */
+    uint8_t post; /**< Set if the task is passed the payload */
+    uint8_t prio; /**< Level to add it to */
+    sched_handle_t handle; /**< Token handle, or 0 for a slot handle */
+#ifdef SCHED_PROFILE
+    uint16_t queued; /**< Profiling clock when posted */
+#endif
+} task_in_t;
+
+/* A handle is a 25 bit positive int: the context which added the task
+ * (0 for main, 1-3 for the lo, med and hi interrupt levels) in bits
+ * 23-24, a 15 bit generation in bits 8-22, and an index in bits 0-7.
+ * A stale handle is only mistaken for a new task once its slot or token
+ * has been reused 32768 times.
+ * Tasks added by the main context are identified by their run queue
+ * slot. Tasks added by an interrupt don't have a slot until they are
+ * moved to the run queue, so take a token from a pool for their level
+ * instead, which they keep until they are run.
+ *
+ * The generation is kept in a cell for each slot or token, along with
+ * _CELL_DEAD, which is set once the task has been cancelled or run.
+ */
+#define _CELL_GEN 0x7fff
+#define _CELL_DEAD 0x8000
+#define _HANDLE_MAX 0x1ffffffL
+#define _handle(ctx, gen, idx) (((sched_handle_t)(ctx) << 23) | \
+    ((sched_handle_t)(gen) << 8) | (idx))
+#define _handle_ctx(h) ((uint8_t)((h) >> 23))
+#define _handle_gen(h) ((uint16_t)((h) >> 8) & _CELL_GEN)
+#define _handle_idx(h) ((uint8_t)(h))
+
+QUEUE_TYPE(_token, uint8_t)
+
+/* tokens for tasks added by each interrupt level, and their free lists,
+ * which the dispatcher produces to and the interrupt level consumes.
+ * Each level has enough to fill both the run queue and its ingress queue,
+ * so running out of tokens never stops an interrupt adding a task */
+uint16_t *_token_cell[3];
+_token_t _token_free[3];
+uint8_t _tokens; /* tokens per level */
+
+/* in task_in_t, marks a deadline task rather than a priority level */
+#define _PRIO_EDF SCHED_LEVELS
+
+/* what a deadline task consists of in the heap */
+typedef struct {
+    sched_task_t *task; /**< Task to run, keyed by its deadline */
+#ifdef SCHED_PROFILE
+    uint16_t queued; /**< Profiling clock when posted */
+#endif
+} edf_t;
+
+/* heap of deadline tasks, earliest at the top */
+edf_t *_edf = NULL;
+uint8_t _edf_len;
+uint8_t _edf_count;
+
+void _sched_task_call(void *data);
+
+QUEUE_TYPE(_ingress, task_in_t)
+
+/* tasks posted from the low, medium and high interrupt levels */
+_ingress_t _ingress[3];
+task_in_t _ingress_buf[3][SCHED_INGRESS];
+/* set by an interrupt after posting, so the dispatcher only looks at the
+ * ingress queues when there may be something in them */
+volatile uint8_t _ingress_pending;
+
 /**< Process table is defined by init, so we only have a buffer here */
 task_t *_runq = NULL; /* this pointer can be cached since it doesn't change */
-volatile task_t *_runq_start;
-volatile task_t *_runq_end;
-volatile uint8_t _runq_len;
-volatile uint8_t _runq_entries;
+uint8_t _runq_free; /* first slot on the free list */
+uint8_t _runq_head[SCHED_LEVELS]; /* oldest slot in each level */
+uint8_t _runq_tail[SCHED_LEVELS]; /* newest slot in each level */
+uint8_t _runq_ready; /* bit n set when level n has tasks */
+uint8_t _runq_len;
+uint8_t _runq_entries;
+
+/* idle accounting */
+uint16_t (*_idle_clock)(void) = NULL;
+sched_idle_stats_t _idle_stats;
+uint16_t _idle_woke; /* clock when we last woke */
+uint8_t _idle_waking; /* set until the first dispatch after a wake */
+void _sched_wake_latency(void);
+
+#ifdef SCHED_PROFILE
+/* what we know about each task function */
+typedef struct {
+    void (*fn)(void *); /**< Task function, NULL for an unused entry */
+    uint16_t calls; /**< Number of times run */
+    uint32_t total; /**< Total runtime */
+    uint16_t max; /**< Longest runtime */
+    uint16_t wait_max; /**< Longest time in the run queue */
+} sched_profile_t;
+
+sched_profile_t *_prof = NULL;
+uint8_t _prof_len;
+uint16_t _prof_lost; /* calls with no free entry to count them in */
+uint8_t _prof_peak; /* run queue high-water mark */
+uint16_t (*_prof_clock)(void);
+
+void _sched_profile(void (*fn)(void *), void *data, uint16_t queued);
+#endif // SCHED_PROFILE
+
+/* lowest set bit of a nibble, for finding the highest ready level */
+const uint8_t _runq_ffs[16] PROGMEM = {
+    0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0
+};
 
 int sched_simple_init(uint8_t qlen) {
-    
+    uint8_t n, *tokens;
+    uint16_t size, *cells;
+
     /* you may not call us twice */
     if (_runq) {
         return -EINVAL;
     }
+    /* we need at least one slot, and _RUNQ_NONE can't be a slot */
+    if (!qlen || qlen == _RUNQ_NONE) {
+        return -EINVAL;
+    }
     /* allocate space for the queue */
     _runq = malloc(sizeof(task_t)*qlen);
     if (!_runq) {
@@ -88,151 +236,983 @@ int sched_simple_init(uint8_t qlen) {
         return -ENOMEM;
     }
 
-    /* reset various pointers */
-    _runq_start = _runq;
-    _runq_end = _runq;
+    /* reset the memory */
+    memset(_runq,0,sizeof(task_t)*qlen);
+
+    /* the token index is a byte, and _RUNQ_NONE is as good a limit as any */
+    if (qlen + SCHED_INGRESS - 1 > _RUNQ_NONE) {
+        _tokens = _RUNQ_NONE;
+    } else {
+        _tokens = qlen + SCHED_INGRESS - 1;
+    }
+    /* a free list holds one less than its power of two size */
+    for (size = 2; size <= _tokens; size <<= 1);
+    /* cells first, so they are aligned wherever that matters */
+    cells = malloc((sizeof(uint16_t)*_tokens + size)*3);
+    if (!cells) {
+        k_debug("failed to allocate memory for tokens");
+        free(_runq);
+        _runq = NULL;
+        return -ENOMEM;
+    }
+    tokens = (uint8_t *)(cells + _tokens*3);
+
+    /* every slot starts on the free list */
+    for (n = 0; n < qlen; n++) {
+        _runq[n].next = n + 1;
+        _runq[n].gen = _CELL_DEAD;
+    }
+    _runq[qlen - 1].next = _RUNQ_NONE;
+    _runq_free = 0;
+
+    /* and every level is empty */
+    for (n = 0; n < SCHED_LEVELS; n++) {
+        _runq_head[n] = _RUNQ_NONE;
+        _runq_tail[n] = _RUNQ_NONE;
+    }
+    _runq_ready = 0;
     _runq_entries = 0;
     _runq_len = qlen;
 
-    k_info("sched_simple run queue: start=%x;qlen=%d;end=%x",_runq, qlen, _runq + qlen);
+    for (n = 0; n < 3; n++) {
+        _ingress_init(&_ingress[n],_ingress_buf[n],SCHED_INGRESS);
+        _token_cell[n] = cells + _tokens*n;
+        _token_init(&_token_free[n],tokens + size*n,size);
+    }
+    for (n = 0; n < _tokens; n++) {
+        _token_cell[0][n] = _CELL_DEAD;
+        _token_cell[1][n] = _CELL_DEAD;
+        _token_cell[2][n] = _CELL_DEAD;
+        _token_push_unsafe(&_token_free[0],&n);
+        _token_push_unsafe(&_token_free[1],&n);
+        _token_push_unsafe(&_token_free[2],&n);
+    }
 
-    /* reset the memory */
-    memset(_runq,0,sizeof(task_t)*qlen);
+    k_info("sched_simple run queue: start=%x;qlen=%d;end=%x",_runq, qlen, _runq + qlen);
 
     return 0;
 }
 
-/* rotate the ring pointer backwards */
-/* MUST BE CALLED WITH INTERRUPTS OFF */
-__attribute__((always_inline)) inline void _runq_back(task_t **p) {
-    if (*p == _runq) {
-        (*p) = _runq + _runq_len;
-    } else {
-        (*p)--;
+/* is deadline a before deadline b */
+#define _edf_before(a, b) ((int16_t)((a) - (b)) < 0)
+
+/* add a deadline task to the heap */
+/* ONLY THE MAIN CONTEXT MAY CALL THIS */
+int _edf_push(const task_in_t *in) {
+    sched_task_t *task = in->arg.data;
+    uint8_t n, parent;
+
+    if (_edf_count >= _edf_len) {
+        return -ENOMEM;
+    }
+    /* sift up from the bottom */
+    n = _edf_count++;
+    while (n) {
+        parent = (n - 1) >> 1;
+        if (!_edf_before(task->deadline,_edf[parent].task->deadline)) {
+            break;
+        }
+        _edf[n] = _edf[parent];
+        n = parent;
     }
+    _edf[n].task = task;
+#ifdef SCHED_PROFILE
+    _edf[n].queued = in->queued;
+#endif
+
+    return 0;
 }
 
-/* rotate the ring pointer forwards */
-/* MUST BE CALLED WITH INTERRUPTS OFF */
-__attribute__((always_inline)) inline void _runq_forward(task_t **p) {
-    if (*p == _runq + _runq_len) {
-        (*p) = _runq;
-    } else {
-        (*p)++;
+/* take the earliest deadline task from the heap, as a run queue entry */
+/* ONLY THE MAIN CONTEXT MAY CALL THIS */
+void _edf_pop(task_t *t) {
+    sched_task_t *task = _edf[0].task;
+    edf_t last;
+    uint8_t n = 0, child;
+
+    t->fn = &_sched_task_call;
+    t->arg.data = task;
+    t->post = 0;
+#ifdef SCHED_PROFILE
+    t->queued = _edf[0].queued;
+#endif
+    if (_edf_before(task->deadline,sched_ticks())) {
+        task->misses++;
+    }
+
+    /* sift the last entry down from the top */
+    last = _edf[--_edf_count];
+    while (1) {
+        child = (n << 1) + 1;
+        if (child >= _edf_count) {
+            break;
+        }
+        if (child + 1 < _edf_count &&
+            _edf_before(_edf[child + 1].task->deadline,
+            _edf[child].task->deadline)) {
+            child++;
+        }
+        if (!_edf_before(_edf[child].task->deadline,last.task->deadline)) {
+            break;
+        }
+        _edf[n] = _edf[child];
+        n = child;
     }
+    _edf[n] = last;
 }
 
-/* push a task on to the top of the stack */
-/* THIS MUST BE CALLED WITH INTERRUPTS OFF */
-int _runq_push_start(void (*fn)(void *),void *data) {
+/* put a task on the end of its level */
+/* ONLY THE MAIN CONTEXT MAY CALL THIS */
+sched_handle_t _runq_push(const task_in_t *in) {
+    uint8_t slot, level = in->prio;
+
+    if (level == _PRIO_EDF) {
+        return _edf_push(in);
+    }
+
     /* check to see if we have anywhere to put this */
-    if (_runq_entries == _runq_len) {
+    slot = _runq_free;
+    if (slot == _RUNQ_NONE) {
         return -ENOMEM;
     }
-    /* push the current point backwards */
-    _runq_back((task_t **)&_runq_start);
-    /* update the number of tasks */
+    _runq_free = _runq[slot].next;
+
+    /* fill in the slot */
+    _runq[slot].fn = in->fn;
+    _runq[slot].arg = in->arg;
+    _runq[slot].post = in->post;
+    _runq[slot].next = _RUNQ_NONE;
+    _runq[slot].gen = (_runq[slot].gen + 1) & _CELL_GEN;
+    /* tasks from interrupts keep their token, others use the slot */
+    if (_handle_ctx(in->handle)) {
+        _runq[slot].handle = in->handle;
+    } else {
+        _runq[slot].handle = _handle(0,_runq[slot].gen,slot);
+    }
+#ifdef SCHED_PROFILE
+    _runq[slot].queued = in->queued;
+#endif
+
+    /* link it on the end of the level */
+    if (_runq_ready & (1 << level)) {
+        _runq[_runq_tail[level]].next = slot;
+    } else {
+        _runq_head[level] = slot;
+        _runq_ready |= (1 << level);
+    }
+    _runq_tail[level] = slot;
     _runq_entries++;
-    /* update the runq entry we just made */
-    _runq_start->fn = fn;
-    _runq_start->data = data;
-    k_debug("_runq_start=%x",_runq_start);
+#ifdef SCHED_PROFILE
+    if (_runq_entries > _prof_peak) {
+        _prof_peak = _runq_entries;
+    }
+#endif
+    k_debug("level=%d;slot=%d",level,slot);
 
-    return 0;
+    return _runq[slot].handle;
 }
 
-/* put a task on the bottom of the queue */
-/* THIS MUST BE CALLED WITH INTERRUPTS OFF */
-int _runq_push_end(void (*fn)(void *),void *data) {
-    /* check to see if we have anywhere to put this */
-    if (_runq_entries == _runq_len) {
-        return -ENOMEM;
+/* find the cell which records if a task has been cancelled */
+uint16_t *_handle_cell(sched_handle_t handle) {
+    if (_handle_ctx(handle)) {
+        return &_token_cell[_handle_ctx(handle) - 1][_handle_idx(handle)];
     }
-    /* advance the end of the ring */
-    _runq_forward((task_t **)&_runq_end);
-    /* update entry count */
-    _runq_entries++;
-    /* update the runq entry we just made */
-    _runq_end->fn = fn;
-    _runq_end->data = data;
-    k_debug("_runq_end=%x",_runq_end);
-    return 0;
+    return &_runq[_handle_idx(handle)].gen;
 }
 
-/* retrieve the top task on the runq */
-/* THIS MUST BE CALLED WITH INTERUPTS OFF */
-task_t *_runq_pop_start(void) {
-    task_t *ret;
+/* mark a task taken from the run queue as done with, giving back its
+ * token if it has one, and return non-zero if it was cancelled */
+/* ONLY THE MAIN CONTEXT MAY CALL THIS */
+uint8_t _runq_retire(sched_handle_t handle) {
+    uint16_t *cell;
+    uint8_t dead, idx;
+
+    cell = _handle_cell(handle);
+    dead = !!(*cell & _CELL_DEAD);
+    *cell |= _CELL_DEAD;
+    if (_handle_ctx(handle)) {
+        idx = _handle_idx(handle);
+        _token_push(&_token_free[_handle_ctx(handle) - 1],&idx);
+    }
+    return dead;
+}
+
+/* retrieve the oldest task from the highest ready level */
+/* ONLY THE MAIN CONTEXT MAY CALL THIS */
+task_t *_runq_pop(void) {
+    uint8_t ready, level, slot;
+
     /* if we're empty, then return nothing */
-    if (!_runq_entries) {
+    ready = _runq_ready;
+    if (!ready) {
         return NULL;
     }
-    /* the top of the stack is what we're returning */
-    ret = (task_t *)_runq_start;
-    _runq_forward((task_t **)&_runq_start);
+    /* find the highest level with anything waiting */
+    if (ready & 0x0f) {
+        level = pgm_read_byte(&_runq_ffs[ready & 0x0f]);
+    } else {
+        level = 4 + pgm_read_byte(&_runq_ffs[ready >> 4]);
+    }
+
+    /* unlink the oldest slot of that level */
+    slot = _runq_head[level];
+    _runq_head[level] = _runq[slot].next;
+    if (_runq_head[level] == _RUNQ_NONE) {
+        _runq_ready &= ~(1 << level);
+    }
+
+    /* the slot goes back on the free list, the caller must copy it
+     * before anything else is added */
+    _runq[slot].next = _runq_free;
+    _runq_free = slot;
     _runq_entries--;
     k_debug("entries=%d",_runq_entries);
-    /* return our, hopefully safe copy of the task */
-    return ret;
+
+    return &_runq[slot];
+}
+
+/* move tasks posted by interrupts into the run queue, highest level
+ * first, leaving anything there isn't room for yet */
+/* ONLY THE MAIN CONTEXT MAY CALL THIS */
+void _runq_merge(void) {
+    task_in_t *in;
+    uint8_t n = 3;
+
+    if (!_ingress_pending) {
+        return;
+    }
+    /* cleared first, so a post after this either gets seen below or sets
+     * it again */
+    _ingress_pending = 0;
+    while (n--) {
+        while ((in = _ingress_peek(&_ingress[n]))) {
+            if (_runq_push(in) < 0) {
+                /* come back for the rest once there is room */
+                _ingress_pending = 1;
+                return;
+            }
+            _ingress_drop(&_ingress[n]);
+        }
+    }
+}
+
+/* which context we are called in, 0 for main, 1-3 for the highest of
+ * the lo, med and hi interrupt levels executing */
+uint8_t _sched_ctx(void) {
+    uint8_t status = PMIC.STATUS;
+
+    if (status & PMIC_HILVLEX_bm) {
+        return 3;
+    } else if (status & PMIC_MEDLVLEX_bm) {
+        return 2;
+    } else if (status & PMIC_LOLVLEX_bm) {
+        return 1;
+    }
+    return 0;
+}
+
+/* add a task from whatever context we are called in, returning its
+ * handle, if want is set the task can be cancelled with it */
+sched_handle_t _sched_enqueue(task_in_t *in, uint8_t want) {
+    uint8_t ctx, n, t;
+    uint16_t gen;
+    _ingress_t *q;
+
+#ifdef SCHED_PROFILE
+    if (_prof) {
+        in->queued = _prof_clock();
+    }
+#endif
+    in->handle = 0;
+    /* the main context owns the run queue, so goes straight in */
+    ctx = _sched_ctx();
+    if (!ctx) {
+        return _runq_push(in);
+    }
+    /* an ISR uses the queue for the highest level executing, which only
+     * ISRs at that level can be producing to, so needs no locking */
+    n = ctx - 1;
+    q = &_ingress[n];
+    /* check for room first, since we can't give a token back */
+    if (_ingress_used(q) == q->mask) {
+        return -ENOMEM;
+    }
+    if (want) {
+        if (!_token_pop(&_token_free[n],&t)) {
+            return -ENOMEM;
+        }
+        gen = (_token_cell[n][t] + 1) & _CELL_GEN;
+        _token_cell[n][t] = gen;
+        in->handle = _handle(n + 1,gen,t);
+    }
+    _ingress_push(q,in);
+    _ingress_pending = 1;
+    return in->handle;
+}
+
+/* add a task to a priority level */
+sched_handle_t _sched_run(void (*fn)(void *), void *data, sched_prio_t prio,
+    uint8_t want) {
+    task_in_t in;
+
+    /* you may not call us without init */
+    if (!_runq) {
+        return -EINVAL;
+    }
+    if (prio >= SCHED_LEVELS) {
+        /* something else, just don't bother */
+        return -EINVAL;
+    }
+
+    in.fn = fn;
+    in.arg.data = data;
+    in.post = 0;
+    in.prio = prio;
+    return _sched_enqueue(&in,want);
 }
 
 /* wrappers to the various cases */
 int sched_run(void (*fn)(void *),void *data,sched_prio_t prio) {
+    sched_handle_t ret;
+
+    /* no token, so an interrupt never runs out of them for this */
+    ret = _sched_run(fn,data,prio,0);
+    if (ret < 0) {
+        return ret;
+    }
+    return 0;
+}
+
+sched_handle_t sched_run_handle(void (*fn)(void *),void *data,
+    sched_prio_t prio) {
+    return _sched_run(fn,data,prio,1);
+}
+
+int sched_cancel(sched_handle_t handle) {
+    uint16_t *cell;
+    uint8_t idx;
+
+    /* you may not call us without init, or from an interrupt */
+    if (!_runq || handle < 0 || handle > _HANDLE_MAX ||
+        (PMIC.STATUS & (PMIC_HILVLEX_bm | PMIC_MEDLVLEX_bm | PMIC_LOLVLEX_bm))) {
+        return -EINVAL;
+    }
+    idx = _handle_idx(handle);
+    if (_handle_ctx(handle) ? idx >= _tokens : idx >= _runq_len) {
+        return -EINVAL;
+    }
+
+    /* only if it's the same task, and hasn't already run */
+    cell = _handle_cell(handle);
+    if (*cell != _handle_gen(handle)) {
+        return -EINVAL;
+    }
+    /* leave it where it is, the dispatcher skips it when it gets there */
+    *cell |= _CELL_DEAD;
+
+    return 0;
+}
+
+/* registered tasks are queued as this trampoline, with the task as data,
+ * so the pending flag can be cleared just before the task runs */
+void _sched_task_call(void *data) {
+    sched_task_t *task = data;
+
+    /* only the flag of the context which queued it is set */
+    task->pending[task->owner] = 0;
+    (task->fn)(task->data);
+}
+
+int sched_task_init(sched_task_t *task, void (*fn)(void *), void *data,
+    sched_prio_t prio) {
+    if (!task || !fn || prio >= SCHED_LEVELS) {
+        return -EINVAL;
+    }
+    task->fn = fn;
+    task->data = data;
+    task->prio = prio;
+    memset((void *)task->pending,0,sizeof(task->pending));
+    task->owner = 0;
+    task->deadline = 0;
+    task->misses = 0;
+
+    return 0;
+}
+
+/* Claim a task for the given context to queue, returning 0 if it is
+ * already waiting. Each context has its own pending flag, which only it
+ * sets, and may only claim the task if no other flag is set. A context
+ * is only ever interrupted by higher levels, which run to completion, so
+ * by setting our flag before looking at the others, either we see the
+ * flag of a level which got in first, or it saw ours and backed off.
+ * This needs no interrupts turned off, unlike a shared test and set. */
+uint8_t _sched_task_claim(sched_task_t *task, uint8_t ctx) {
+    uint8_t n;
+
+    if (task->pending[ctx]) {
+        return 0;
+    }
+    task->pending[ctx] = 1;
+    for (n = 0; n < SCHED_CONTEXTS; n++) {
+        if (n != ctx && task->pending[n]) {
+            task->pending[ctx] = 0;
+            return 0;
+        }
+    }
+    task->owner = ctx;
+    return 1;
+}
+
+int sched_task_run(sched_task_t *task) {
+    uint8_t ctx;
+    sched_handle_t ret;
+
+    /* you may not call us without init */
+    if (!_runq || !task) {
+        return -EINVAL;
+    }
+
+    /* already waiting, it will see whatever we were posted for */
+    ctx = _sched_ctx();
+    if (!_sched_task_claim(task,ctx)) {
+        return 0;
+    }
+
+    ret = _sched_run(&_sched_task_call,task,task->prio,0);
+    if (ret < 0) {
+        task->pending[ctx] = 0;
+        return ret;
+    }
+    return 0;
+}
+
+int sched_edf_init(uint8_t count) {
+    /* you may not call us twice, or without the run queue */
+    if (_edf || !_runq || !count) {
+        return -EINVAL;
+    }
+    _edf = malloc(sizeof(edf_t)*count);
+    if (!_edf) {
+        k_debug("failed to allocate memory for edf heap");
+        return -ENOMEM;
+    }
+    _edf_len = count;
+    _edf_count = 0;
+
+    return 0;
+}
+
+int sched_task_run_by(sched_task_t *task, uint16_t deadline) {
+    task_in_t in;
+    uint8_t ctx;
+    sched_handle_t ret;
+
+    /* you may not call us without init */
+    if (!_edf || !task) {
+        return -EINVAL;
+    }
+
+    /* already waiting, with the deadline it has or none, so it won't be
+     * run by this one */
+    ctx = _sched_ctx();
+    if (!_sched_task_claim(task,ctx)) {
+        return -EBUSY;
+    }
+
+    task->deadline = deadline;
+    in.fn = &_sched_task_call;
+    in.arg.data = task;
+    in.post = 0;
+    in.prio = _PRIO_EDF;
+    ret = _sched_enqueue(&in,0);
+    if (ret < 0) {
+        task->pending[ctx] = 0;
+        return ret;
+    }
+    return 0;
+}
+
+uint16_t sched_task_misses(sched_task_t *task) {
+    if (!task) {
+        return 0;
+    }
+    return task->misses;
+}
+
+sched_handle_t sched_task_run_after(sched_task_t *task, uint16_t ticks) {
+    /* 0 could be taken for a handle, use sched_task_run() instead */
+    if (!task || !ticks) {
+        return -EINVAL;
+    }
+    return sched_run_after(&_sched_task_call,task,ticks);
+}
+
+sched_handle_t sched_post(void (*fn)(void *), const void *payload, uint8_t len,
+    sched_prio_t prio) {
+    task_in_t in;
+
     /* you may not call us without init */
     if (!_runq) {
         return -EINVAL;
     }
-    
-    switch (prio) {
-        case sched_later:
-            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-                return _runq_push_end(fn,data);
-            }
-            break;
-        case sched_now:
-            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-                return _runq_push_start(fn,data);
-            }
-            break;
-        default:
-            break;
+    if (prio >= SCHED_LEVELS || len > SCHED_PAYLOAD || (len && !payload)) {
+        return -EINVAL;
     }
 
-    /* something else, just don't bother */
-    return -EINVAL;
+    in.fn = fn;
+    memset(in.arg.payload,0,SCHED_PAYLOAD);
+    if (len) {
+        memcpy(in.arg.payload,payload,len);
+    }
+    in.post = 1;
+    in.prio = prio;
+    return _sched_enqueue(&in,1);
+}
+
+/* is there anything waiting to run? */
+uint8_t _sched_busy(void) {
+    return (_runq_ready || _edf_count || _ingress_pending);
 }
 
-/* the actual job schedular */
 void sched_simple(void) {
+    sched_simple_run(0,0);
+}
+
+/* the actual job schedular */
+int sched_simple_run(uint8_t max_tasks, uint16_t max_ticks) {
     task_t task, *next = NULL;
+    void *arg;
+    uint8_t ran = 0;
+    uint16_t start = 0;
 
     /* you may not call us without init */
     if (!_runq) {
-        return;
+        return -EINVAL;
+    }
+    if (max_ticks) {
+        start = sched_ticks();
     }
 
-    /* loop until nothing more to run */
+    /* loop until nothing more to run, or out of budget */
     while (1) {
-        /* we must retreive and copy the task with interrupts off */
-        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-            /* obtain the next task */
-            next = _runq_pop_start();
+        /* pick up anything posted by interrupts since last time */
+        _runq_merge();
+        /* obtain the next task, deadline tasks first. only we touch the
+         * run queue, so there is no need to turn interrupts off */
+        if (_edf_count) {
+            _edf_pop(&task);
+        } else if ((next = _runq_pop())) {
             /* make a copy of it somewhere safe */
-            if (next) {
-                k_debug("next=%x",next);
-                memcpy(&task,next,sizeof(task_t));
-            } else {
-                /* nothing to run, indicate upwards */
-                task.fn = NULL;
+            k_debug("next=%x",next);
+            memcpy(&task,next,sizeof(task_t));
+            /* skip it if it was cancelled */
+            if (_runq_retire(task.handle)) {
+                continue;
             }
+        } else {
+            /* nothing to run, indicate upwards */
+            task.fn = NULL;
         }
         /* do actual execution */
         if (task.fn) {
-            //k_debug("call %x(%x)",task.fn,task.data);
+            if (_idle_waking) {
+                _sched_wake_latency();
+            }
+            /* posted tasks get our copy of their payload */
+            if (task.post) {
+                arg = task.arg.payload;
+            } else {
+                arg = task.arg.data;
+            }
+            //k_debug("call %x(%x)",task.fn,arg);
+#ifdef SCHED_PROFILE
+            if (_prof) {
+                _sched_profile(task.fn,arg,task.queued);
+            } else
+#endif
             /* safe to now run the task */
-            (task.fn)(task.data);
+            (task.fn)(arg);
         } else {
             break;
         }
+        /* give control back if we've used up our budget */
+        ran++;
+        if (max_tasks && ran >= max_tasks) {
+            break;
+        }
+        if (max_ticks && (uint16_t)(sched_ticks() - start) >= max_ticks) {
+            break;
+        }
     }
+    /* a wake which ran nothing doesn't count towards latency */
+    _idle_waking = 0;
+
+    return _sched_busy();
+}
+
+void sched_idle(void) {
+    uint16_t start = 0;
+
+    /* you may not call us without init */
+    if (!_runq) {
+        return;
+    }
+
+    cli();
+    if (_sched_busy()) {
+        sei();
+        return;
+    }
+    if (_idle_clock) {
+        start = _idle_clock();
+    }
+    /* enables interrupts as it sleeps */
+    sleep_enter();
+    _idle_stats.sleeps++;
+    if (_idle_clock) {
+        _idle_woke = _idle_clock();
+        _idle_stats.asleep += (uint16_t)(_idle_woke - start);
+        _idle_waking = 1;
+    }
+}
+
+/* account for the time from waking to dispatching the first task */
+void _sched_wake_latency(void) {
+    uint16_t latency;
+
+    _idle_waking = 0;
+    if (!_idle_clock) {
+        return;
+    }
+    latency = _idle_clock() - _idle_woke;
+    _idle_stats.wakes++;
+    _idle_stats.wake_total += latency;
+    if (latency > _idle_stats.wake_max) {
+        _idle_stats.wake_max = latency;
+    }
+}
+
+void sched_idle_clock(uint16_t (*clock)(void)) {
+    _idle_clock = clock;
+    _idle_waking = 0;
+}
+
+void sched_idle_stats(sched_idle_stats_t *stats) {
+    if (stats) {
+        memcpy(stats,&_idle_stats,sizeof(sched_idle_stats_t));
+    }
+}
+
+void sched_idle_stats_reset(void) {
+    memset(&_idle_stats,0,sizeof(sched_idle_stats_t));
+}
+
+#ifdef SCHED_PROFILE
+int sched_profile_init(uint8_t count, uint16_t (*clock)(void)) {
+    /* you may not call us twice */
+    if (_prof || !count || !clock) {
+        return -EINVAL;
+    }
+    _prof = malloc(sizeof(sched_profile_t)*count);
+    if (!_prof) {
+        k_debug("failed to allocate memory for profile");
+        return -ENOMEM;
+    }
+    _prof_len = count;
+    _prof_clock = clock;
+    sched_profile_reset();
+
+    return 0;
+}
+
+void sched_profile_reset(void) {
+    if (!_prof) {
+        return;
+    }
+    memset(_prof,0,sizeof(sched_profile_t)*_prof_len);
+    _prof_lost = 0;
+    _prof_peak = _runq_entries;
+}
+
+/* run a task, and account for it */
+void _sched_profile(void (*fn)(void *), void *data, uint16_t queued) {
+    void (*key)(void *) = fn;
+    sched_profile_t *p = NULL;
+    uint16_t start, wait, runtime;
+    uint8_t n;
+
+    start = _prof_clock();
+    (fn)(data);
+    runtime = _prof_clock() - start;
+    wait = start - queued;
+
+    /* registered tasks are all called via the trampoline, so count them
+     * against the real function */
+    if (fn == &_sched_task_call) {
+        key = ((sched_task_t *)data)->fn;
+    }
+    /* find this function, or the first unused entry */
+    for (n = 0; n < _prof_len; n++) {
+        if (_prof[n].fn == key || !_prof[n].fn) {
+            p = &_prof[n];
+            break;
+        }
+    }
+    if (!p) {
+        _prof_lost++;
+        return;
+    }
+    p->fn = key;
+    p->calls++;
+    p->total += runtime;
+    if (runtime > p->max) {
+        p->max = runtime;
+    }
+    if (wait > p->wait_max) {
+        p->wait_max = wait;
+    }
+}
+
+void sched_profile_dump(FILE *out) {
+    uint8_t n;
+
+    if (!_prof || !out) {
+        return;
+    }
+    fprintf_P(out,PSTR("runq peak %d/%d, unprofiled %u\r\n"),
+        _prof_peak,_runq_len,_prof_lost);
+    fprintf_P(out,PSTR("fn     calls total      max   wait_max\r\n"));
+    for (n = 0; n < _prof_len && _prof[n].fn; n++) {
+        fprintf_P(out,PSTR("%p %5u %10lu %5u %5u\r\n"),_prof[n].fn,
+            _prof[n].calls,_prof[n].total,_prof[n].max,_prof[n].wait_max);
+    }
+}
+#endif // SCHED_PROFILE
+
+/* software timers, on a hashed timing wheel */
+
+#if (SCHED_WHEEL_SLOTS & (SCHED_WHEEL_SLOTS - 1)) || (SCHED_WHEEL_SLOTS > 128)
+#error "SCHED_WHEEL_SLOTS must be a power of two, no more than 128"
+#endif
+
+#define _WHEEL_MASK (SCHED_WHEEL_SLOTS - 1)
+#define _WHEEL_BITS (__builtin_ctz(SCHED_WHEEL_SLOTS))
+#define _TIMER_NONE 0xff
+
+/* what a software timer consists of */
+typedef struct {
+    void (*fn)(void *); /**< Task to run on expiry, NULL when not in use */
+    void *data; /**< Private data for the task */
+    uint16_t period; /**< Ticks between runs, 0 for one-shot */
+    uint16_t rounds; /**< Further trips around the wheel before expiry */
+    uint8_t next; /**< Next timer in the same list, or _TIMER_NONE */
+    uint16_t gen; /**< Generation, so stale handles can be spotted */
+} sched_timer_t;
+
+sched_timer_t *_timers = NULL;
+uint8_t _timers_len;
+uint8_t _timers_free; /* first timer on the free list */
+uint8_t _wheel[SCHED_WHEEL_SLOTS]; /* first timer in each slot */
+volatile uint16_t _sched_ticks;
+
+int sched_timer_init(uint8_t count) {
+    uint8_t n;
+
+    /* you may not call us twice, or without the run queue */
+    if (_timers || !_runq) {
+        return -EINVAL;
+    }
+    if (!count || count == _TIMER_NONE) {
+        return -EINVAL;
+    }
+    _timers = malloc(sizeof(sched_timer_t)*count);
+    if (!_timers) {
+        k_debug("failed to allocate memory for timers");
+        return -ENOMEM;
+    }
+    memset(_timers,0,sizeof(sched_timer_t)*count);
+
+    /* every timer starts on the free list */
+    for (n = 0; n < count; n++) {
+        _timers[n].next = n + 1;
+    }
+    _timers[count - 1].next = _TIMER_NONE;
+    _timers_free = 0;
+    _timers_len = count;
+
+    for (n = 0; n < SCHED_WHEEL_SLOTS; n++) {
+        _wheel[n] = _TIMER_NONE;
+    }
+    _sched_ticks = 0;
+
+    return 0;
+}
+
+/* hash a timer into the wheel, to expire delay ticks from now */
+/* THIS MUST BE CALLED WITH INTERRUPTS OFF */
+void _wheel_insert(uint8_t n, uint16_t delay) {
+    uint8_t slot;
+
+    /* slot s is next visited ((delay-1) % SLOTS) + 1 ticks from now, and
+     * then every SLOTS ticks, so it takes (delay-1) / SLOTS more trips */
+    slot = (_sched_ticks + delay) & _WHEEL_MASK;
+    _timers[n].rounds = (delay - 1) >> _WHEEL_BITS;
+    _timers[n].next = _wheel[slot];
+    _wheel[slot] = n;
+}
+
+/* give a timer back to the free list */
+/* THIS MUST BE CALLED WITH INTERRUPTS OFF */
+void _timer_free(uint8_t n) {
+    _timers[n].fn = NULL;
+    _timers[n].next = _timers_free;
+    _timers_free = n;
+}
+
+/* common code for one-shot and periodic timers */
+sched_handle_t _timer_add(void (*fn)(void *), void *data, uint16_t delay,
+    uint16_t period) {
+    uint8_t n;
+    sched_handle_t ret = -ENOMEM;
+
+    if (!_timers || !fn) {
+        return -EINVAL;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        n = _timers_free;
+        if (n != _TIMER_NONE) {
+            _timers_free = _timers[n].next;
+            _timers[n].fn = fn;
+            _timers[n].data = data;
+            _timers[n].period = period;
+            _timers[n].gen = (_timers[n].gen + 1) & 0x7fff;
+            _wheel_insert(n, delay);
+            /* handle is index plus generation, always positive */
+            ret = ((sched_handle_t)_timers[n].gen << 8) | n;
+        }
+    }
+
+    return ret;
+}
+
+/* queue the task for an expired timer. Registered tasks go through
+ * sched_task_run(), so they keep their priority and are queued at most
+ * once, however many timers and wakeups they have outstanding */
+int _timer_fire(void (*fn)(void *), void *data) {
+    if (fn == &_sched_task_call) {
+        return sched_task_run(data);
+    }
+    return _sched_run(fn,data,sched_now,0);
+}
+
+sched_handle_t sched_run_after(void (*fn)(void *), void *data,
+    uint16_t ticks) {
+    sched_handle_t ret;
+
+    if (!ticks) {
+        ret = _sched_run(fn,data,sched_now,0);
+        return (ret < 0) ? ret : 0;
+    }
+    return _timer_add(fn,data,ticks,0);
+}
+
+sched_handle_t sched_run_every(void (*fn)(void *), void *data,
+    uint16_t period) {
+    if (!period) {
+        return -EINVAL;
+    }
+    return _timer_add(fn,data,period,period);
+}
+
+int sched_timer_cancel(sched_handle_t handle) {
+    uint8_t n;
+    int ret = -EINVAL;
+
+    n = handle & 0xff;
+    if (!_timers || handle < 0 || n >= _timers_len) {
+        return -EINVAL;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        /* only cancel the timer this handle was issued for */
+        if (_timers[n].fn && _timers[n].gen == (handle >> 8)) {
+            /* leave it on the wheel, sched_tick() frees it when it
+             * gets there, which keeps this O(1) */
+            _timers[n].fn = NULL;
+            ret = 0;
+        }
+    }
+
+    return ret;
+}
+
+/* advance the wheel, and expire anything due */
+void sched_tick(void) {
+    uint8_t slot, n, next;
+    sched_timer_t *t;
+    void (*fn)(void *);
+    void *data;
+    int ret;
+
+    if (!_timers) {
+        return;
+    }
+
+    /* take the whole list for this slot, anything not due is put back */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _sched_ticks++;
+        slot = _sched_ticks & _WHEEL_MASK;
+        n = _wheel[slot];
+        _wheel[slot] = _TIMER_NONE;
+    }
+
+    while (n != _TIMER_NONE) {
+        fn = NULL;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            t = &_timers[n];
+            next = t->next;
+            if (!t->fn) {
+                /* cancelled */
+                t->next = _timers_free;
+                _timers_free = n;
+            } else if (t->rounds) {
+                /* not this time around */
+                t->rounds--;
+                t->next = _wheel[slot];
+                _wheel[slot] = n;
+            } else {
+                /* due, it stays off the wheel while it is queued */
+                fn = t->fn;
+                data = t->data;
+            }
+        }
+        /* queue it with interrupts on, adding tasks needs no locking */
+        if (fn) {
+            ret = _timer_fire(fn,data);
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                if (!t->fn) {
+                    /* cancelled while we were queueing it */
+                    _timer_free(n);
+                } else if (ret < 0) {
+                    /* no room to queue it, try again next tick */
+                    _wheel_insert(n,1);
+                } else if (t->period) {
+                    _wheel_insert(n,t->period);
+                } else {
+                    _timer_free(n);
+                }
+            }
+        }
+        n = next;
+    }
+}
+
+uint16_t sched_ticks(void) {
+    uint16_t ret;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ret = _sched_ticks;
+    }
+    return ret;
 }
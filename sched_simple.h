@@ -32,7 +32,9 @@
  * it requires between executes.
  *
  * There is no yield(), instead the function should update it's own state
- * to a suitable place to enter again when called, and return.
+ * to a suitable place to enter again when called, and return. sched_co.h
+ * has macros which do this for you, so a task can be written as straight
+ * line code which waits for events.
  *
  * Task functions have only one argument: a pointer to some data that may
  * be useful. This pointer may be NULL, so should be checked. No guarantees
@@ -47,24 +49,158 @@
  * of possible tasks which may execute on the system. That is, only the
  * pending tasks actually told to run will count against this limit.
  *
- * A task cannot be destroyed. A task may call itself to be run again.
+ * A task may call itself to be run again. sched_run_handle() and
+ * sched_post() return a handle, which sched_cancel() can use to stop the
+ * task being run if it is still waiting. A cancelled task stays in the run queue
+ * until the dispatcher gets to it and skips it, so cancelling is O(1).
  *
- * sched_run() accepts two priorities, sched_later which places the task
- * at the end of the run queue, and sched_now which placed it at the top.
- * There are no other priority levels.
+ * sched_run() accepts one of SCHED_LEVELS priority levels. Each level is
+ * a FIFO, and the dispatcher always runs the oldest task from the highest
+ * level with anything waiting. sched_now is the highest level, and
+ * sched_later is the lowest. Finding the highest ready level is O(1),
+ * using a bitmap of levels with tasks waiting.
+ *
+ * Only the main context, where sched_simple() runs, touches the run queue
+ * itself. Tasks added from an interrupt go into a small lock-free queue
+ * for that PMIC interrupt level, which the dispatcher moves into the run
+ * queue before picking each task. So adding a task never turns interrupts
+ * off, and nor does the dispatcher. sched_simple() and sched_idle() must
+ * only be called from the main context.
+ *
+ * Tasks may also be run after a delay, or periodically, with
+ * sched_run_after() and sched_run_every(). These are driven by calling
+ * sched_tick() from a single periodic interrupt, eg a timer or RTC
+ * overflow hook. The software timers live on a hashed timing wheel of
+ * SCHED_WHEEL_SLOTS slots, so adding a timer is O(1) and each tick only
+ * looks at the timers hashed to the current slot. When a timer expires,
+ * its task is added to the run queue at sched_now, or at its own level
+ * for a registered task. Interrupts are only turned off to move a timer
+ * between lists, never while adding its task.
+ *
+ * A task which is posted far more often than it runs, eg from a receive
+ * interrupt, should be registered with sched_task_init() and posted with
+ * sched_task_run(). A registered task is only ever in the run queue once:
+ * posting it again while it is still waiting is just a flag test and uses
+ * no run queue slot. The pending flag is cleared just before the task is
+ * called, so anything posted while it runs will run it again.
+ *
+ * A task which needs to be handed a value, eg a received byte or an ADC
+ * sample, can be added with sched_post() instead. Up to SCHED_PAYLOAD
+ * bytes are copied into the run queue slot, and the task is given a
+ * pointer to its own copy in place of the data pointer, valid until the
+ * task returns. Every post is a separate run with its own copy, so there
+ * is no shared variable for an interrupt and the task to race on.
+ *
+ * Tasks with a deadline can be run earliest deadline first instead. Once
+ * sched_edf_init() has been called, sched_task_run_by() adds a registered
+ * task along with the tick it must run by. All deadline tasks run before
+ * any priority level, earliest deadline first, using a binary heap. A
+ * task which starts after its deadline is still run, and counted as a
+ * miss against the task.
+ *
+ * Once sched_simple() returns, the main loop should call sched_idle(),
+ * which sleeps in the deepest mode allowed by the running drivers (see
+ * sleep.h) if the run queue is still empty. Given a clock with
+ * sched_idle_clock(), it also records how long was spent asleep, and the
+ * latency from waking to the first task being dispatched.
+ *
+ * Building with SCHED_PROFILE defined adds per-task profiling: for each
+ * task function, the number of calls, total and longest runtime, and the
+ * longest wait in the run queue, along with the run queue high-water
+ * mark. Without SCHED_PROFILE, the profiling functions are empty inlines,
+ * so calls to them may be left in place.
  */
 
+/** \brief Number of slots in the timing wheel, must be a power of two
+ *
+ *  More slots means fewer timers to look at per tick, at the cost of one
+ *  byte of RAM per slot.
+ */
+#ifndef SCHED_WHEEL_SLOTS
+#define SCHED_WHEEL_SLOTS 16
+#endif
+
+/** \brief Largest payload which can be given to sched_post()
+ *
+ *  Every run queue slot is big enough for this, or a data pointer.
+ */
+#ifndef SCHED_PAYLOAD
+#define SCHED_PAYLOAD 4
+#endif
+
+/** \brief Size of the queue of tasks added from each interrupt level
+ *
+ *  Must be a power of two, and holds one less than this. Tasks added by
+ *  interrupts wait here until the dispatcher next runs, so this limits
+ *  how many each interrupt level can add in that time.
+ */
+#ifndef SCHED_INGRESS
+#define SCHED_INGRESS 8
+#endif
+
+/** \brief Number of priority levels */
+#define SCHED_LEVELS 8
+
+/** \brief Number of contexts which can add tasks: main, and the lo, med
+ *  and hi interrupt levels */
+#define SCHED_CONTEXTS 4
+
+/** \brief Handle to a cancellable task or a timer
+ *
+ *  Handles are 0 or more, functions returning one return a negative
+ *  errors.h value instead on failure. A handle carries a 15 bit generation,
+ *  so it is not mistaken for a later task or timer until the same slot has
+ *  been reused 32768 times.
+ */
+typedef int32_t sched_handle_t;
+
 /** \brief Task priority for being added to run queue */
 typedef enum {
-    sched_now = 0,  /**< Task runs immediately */
-    sched_later     /**< Task runs some other time */
+    sched_now = 0,  /**< Task runs before anything else */
+    sched_prio1,    /**< Priority level 1 */
+    sched_prio2,    /**< Priority level 2 */
+    sched_prio3,    /**< Priority level 3 */
+    sched_prio4,    /**< Priority level 4 */
+    sched_prio5,    /**< Priority level 5 */
+    sched_prio6,    /**< Priority level 6 */
+    sched_later     /**< Task runs when nothing else is waiting */
 } sched_prio_t;
 
+/** \brief A registered task, which is queued at most once at a time
+ *
+ *  Treat the contents as private, set them up with sched_task_init().
+ */
+typedef struct {
+    void (*fn)(void *); /**< Task entry point */
+    void *data; /**< Private data for the task */
+    uint8_t prio; /**< Priority level to run at */
+    volatile uint8_t pending[SCHED_CONTEXTS]; /**< Set by the context which
+        queued it, while in the run queue */
+    uint8_t owner; /**< Context whose pending flag is set */
+    uint16_t deadline; /**< Tick to run by, for sched_task_run_by() */
+    uint16_t misses; /**< Number of deadlines missed */
+} sched_task_t;
+
+/** \brief Sleep and wake statistics, in counts of the sched_idle_clock() */
+typedef struct {
+    uint16_t sleeps; /**< Number of times the CPU slept */
+    uint32_t asleep; /**< Total time asleep, including the waking ISR */
+    uint16_t wakes; /**< Number of wakes which went on to run a task */
+    uint32_t wake_total; /**< Total wake to dispatch latency */
+    uint16_t wake_max; /**< Longest wake to dispatch latency */
+} sched_idle_stats_t;
+
 /** \brief Initalise the scheduler
  *
  *  Must be called before any other scheduling functions!
  *
- *  \param qlen The length of the task run queue
+ *  Besides the run queue, each interrupt level gets a pool of handles for
+ *  the tasks it adds, big enough that any level can fill the run queue.
+ *  These take three to four bytes per run queue slot per level.
+ *
+ *  \param qlen The length of the task run queue, shared by all priority
+ *  levels
+ *  \return 0 on success, errors.h otherwise
  */
 int sched_simple_init(uint8_t qlen);
 
@@ -73,20 +209,269 @@ int sched_simple_init(uint8_t qlen);
  *  Note: during a task, further tasks may be added to the FIFO, therefore
  *  this function only returns when no tasks are able to be executed.
  *  The main loop should probably perform a sleep, or similar, but it safe
- *  to call this even if no tasks have been set to run
+ *  to call this even if no tasks have been set to run. A task which keeps
+ *  adding itself will keep this from returning, use sched_simple_run()
+ *  if the main loop has other work to do.
  */
 void sched_simple(void);
 
+/** \brief Execute tasks in the queue, up to a budget
+ *
+ *  Like sched_simple(), but returns once max_tasks tasks have run, or
+ *  max_ticks scheduler ticks have passed since it was called, so a task
+ *  which keeps adding itself can't keep the main loop from its own work.
+ *  A task is never interrupted, so the tick budget may be overrun by as
+ *  long as the last task takes. The tick budget needs sched_tick() to be
+ *  running.
+ *
+ *  \param max_tasks Most tasks to run, or 0 for no limit
+ *  \param max_ticks Most ticks to run for, or 0 for no limit
+ *  \return 1 if there are still tasks waiting, 0 if not, errors.h
+ *  otherwise
+ */
+int sched_simple_run(uint8_t max_tasks, uint16_t max_ticks);
+
 /**< \brief Add a task to the run queue
  *
- *  With sched_now, it will be added to the head of the run queue.
- *  sched_later adds it to the tail. It may never get executed from the
- *  tail, if more tasks of sched_now are added.
+ *  The task is added to the end of the FIFO for its priority level. It
+ *  will not be executed while tasks of a higher level keep being added.
  *
  *  \param fn Pointer to the function to run as a task
  *  \param data Pointer to the data to use for this invocation
  *  \param prio Priority to add the task at
+ *  \return 0 on success, -ENOMEM if the run queue is full, errors.h
+ *  otherwise
  */
 int sched_run(void(*fn)(void *), void *data, sched_prio_t prio);
 
+/**< \brief Add a task to the run queue, which can be cancelled
+ *
+ *  Same as sched_run(), but returns a handle for sched_cancel(). From an
+ *  interrupt this takes one of the handles pooled for the interrupt level, see
+ *  sched_simple_init().
+ *
+ *  \param fn Pointer to the function to run as a task
+ *  \param data Pointer to the data to use for this invocation
+ *  \param prio Priority to add the task at
+ *  \return Handle for sched_cancel() (0 or more) on success, -ENOMEM if
+ *  the run queue is full, errors.h otherwise
+ */
+sched_handle_t sched_run_handle(void(*fn)(void *), void *data,
+    sched_prio_t prio);
+
+/** \brief Stop a task added by sched_run_handle() or sched_post() from
+ *  running
+ *
+ *  Must only be called from the main context, eg from a task.
+ *
+ *  \param handle Handle returned when the task was added
+ *  \return 0 on success, -EINVAL if the task has already run or been
+ *  cancelled, errors.h otherwise
+ */
+int sched_cancel(sched_handle_t handle);
+
+/** \brief Add a task to the run queue, with a copy of a small payload
+ *
+ *  \param fn Pointer to the function to run as a task, which is passed a
+ *  pointer to its copy of the payload
+ *  \param payload Bytes to copy
+ *  \param len Number of bytes, no more than SCHED_PAYLOAD
+ *  \param prio Priority to add the task at
+ *  \return Handle for sched_cancel() (0 or more) on success, -ENOMEM if
+ *  the run queue is full, errors.h otherwise
+ */
+sched_handle_t sched_post(void(*fn)(void *), const void *payload,
+    uint8_t len, sched_prio_t prio);
+
+/** \brief Set up a registered task
+ *
+ *  \param task Task to set up, must stay valid while it may be posted
+ *  \param fn Pointer to the function to run as a task
+ *  \param data Pointer to the data to use for every invocation
+ *  \param prio Priority to add the task at
+ *  \return 0 on success, errors.h otherwise
+ */
+int sched_task_init(sched_task_t *task, void(*fn)(void *), void *data,
+    sched_prio_t prio);
+
+/** \brief Sleep until an interrupt, if there is nothing to run
+ *
+ *  The run queue is checked with interrupts disabled, and they are only
+ *  enabled again by the sleep itself, so a task added by an interrupt
+ *  just before sleeping is never left waiting for the next interrupt.
+ */
+void sched_idle(void);
+
+/** \brief Set the clock used to measure time asleep and wake latency
+ *
+ *  The clock must keep running in the sleep modes used, eg rtc_count().
+ *  Sleeps longer than one wrap of the clock are undercounted.
+ *
+ *  \param clock Function returning a free running count, or NULL to
+ *  stop measuring
+ */
+void sched_idle_clock(uint16_t (*clock)(void));
+
+/** \brief Retrieve the sleep and wake statistics
+ *
+ *  \param stats Where to copy the statistics to
+ */
+void sched_idle_stats(sched_idle_stats_t *stats);
+
+/** \brief Reset the sleep and wake statistics */
+void sched_idle_stats_reset(void);
+
+/** \brief Add a registered task to the run queue, unless already there
+ *
+ *  \param task Task set up by sched_task_init()
+ *  \return 0 on success or if the task is already waiting, -ENOMEM if the
+ *  run queue is full, errors.h otherwise
+ */
+int sched_task_run(sched_task_t *task);
+
+/** \brief Add a registered task to the run queue after a delay
+ *
+ *  This always arms a new timer. When it expires, the task is added with
+ *  sched_task_run(), at its own priority, and not at all if it is already
+ *  waiting. Cancel the timer with sched_timer_cancel() if the task should
+ *  no longer be woken by it.
+ *
+ *  \param task Task set up by sched_task_init()
+ *  \param ticks Number of ticks to wait, at least 1
+ *  \return Handle for sched_timer_cancel() (0 or more) on success, -ENOMEM
+ *  if all timers are in use, errors.h otherwise
+ */
+sched_handle_t sched_task_run_after(sched_task_t *task, uint16_t ticks);
+
+/** \brief Enable earliest deadline first scheduling
+ *
+ *  Must be called after sched_simple_init(), and before any tasks are
+ *  added with sched_task_run_by().
+ *
+ *  \param count Maximum number of tasks which may be waiting on a deadline
+ *  \return 0 on success, errors.h otherwise
+ */
+int sched_edf_init(uint8_t count);
+
+/** \brief Add a registered task to run by a deadline, unless already there
+ *
+ *  If the task is already waiting, it is left where it is, and -EBUSY is
+ *  returned since it is not being run by this deadline. It keeps the
+ *  deadline it was added with, or has none at all if it was added by
+ *  sched_task_run() or a timer, in which case it runs at its priority
+ *  level, after any deadline tasks.
+ *  Deadlines are compared by subtraction, so must be less than 32768
+ *  ticks in the future.
+ *
+ *  \param task Task set up by sched_task_init(), its priority is not used
+ *  \param deadline Value of sched_ticks() the task should run by
+ *  \return 0 on success, -EBUSY if the task is already waiting, -ENOMEM
+ *  if too many tasks are waiting on deadlines, errors.h otherwise
+ */
+int sched_task_run_by(sched_task_t *task, uint16_t deadline);
+
+/** \brief Return the number of deadlines a task has missed
+ *
+ *  \param task Task set up by sched_task_init()
+ *  \return Number of times the task started after its deadline
+ */
+uint16_t sched_task_misses(sched_task_t *task);
+
+/** \brief Initialise the software timers
+ *
+ *  Must be called after sched_simple_init() and before any other timer
+ *  functions.
+ *
+ *  \param count Maximum number of timers which may be pending at once
+ *  \return 0 on success, errors.h otherwise
+ */
+int sched_timer_init(uint8_t count);
+
+/** \brief Advance the software timers by one tick
+ *
+ *  Call this from one periodic interrupt hook, eg the overflow hook of
+ *  timer_init() or rtc_init(). The tick period sets the resolution of
+ *  all software timers.
+ */
+void sched_tick(void);
+
+/** \brief Number of ticks since the timers were started
+ *
+ *  This wraps at 65536 ticks, so compare tick values by subtraction.
+ *
+ *  \return Current tick count
+ */
+uint16_t sched_ticks(void);
+
+/** \brief Add a task to the run queue after a delay
+ *
+ *  \param fn Pointer to the function to run as a task
+ *  \param data Pointer to the data to use for this invocation
+ *  \param ticks Number of ticks to wait, 0 runs it immediately
+ *  \return Handle for sched_timer_cancel() (0 or more) on success,
+ *  -ENOMEM if all timers are in use, errors.h otherwise
+ */
+sched_handle_t sched_run_after(void(*fn)(void *), void *data,
+    uint16_t ticks);
+
+/** \brief Add a task to the run queue every period ticks
+ *
+ *  The first run is period ticks from now. If the run queue is full when
+ *  the timer expires, it is retried on the next tick.
+ *
+ *  \param fn Pointer to the function to run as a task
+ *  \param data Pointer to the data to use for every invocation
+ *  \param period Number of ticks between runs, must not be 0
+ *  \return Handle for sched_timer_cancel() (0 or more) on success,
+ *  -ENOMEM if all timers are in use, errors.h otherwise
+ */
+sched_handle_t sched_run_every(void(*fn)(void *), void *data,
+    uint16_t period);
+
+/** \brief Stop a pending timer
+ *
+ *  Tasks already added to the run queue by the timer are not affected.
+ *
+ *  \param handle Handle returned by sched_run_after() or sched_run_every()
+ *  \return 0 on success, -EINVAL if the timer already expired or was
+ *  cancelled
+ */
+int sched_timer_cancel(sched_handle_t handle);
+
+#include <stdio.h>
+
+#ifdef SCHED_PROFILE
+/** \brief Start profiling tasks
+ *
+ *  \param count Maximum number of different task functions to profile,
+ *  any more are counted as unprofiled calls
+ *  \param clock Function returning a free running count, eg the count of
+ *  a timer, in which times are measured
+ *  \return 0 on success, errors.h otherwise
+ */
+int sched_profile_init(uint8_t count, uint16_t (*clock)(void));
+
+/** \brief Print the profile of every task
+ *
+ *  \param out Stream to print to, eg stdout
+ */
+void sched_profile_dump(FILE *out);
+
+/** \brief Reset all profiling counters */
+void sched_profile_reset(void);
+#else
+static inline int sched_profile_init(uint8_t count, uint16_t (*clock)(void)) {
+    (void)count;
+    (void)clock;
+    return 0;
+}
+
+static inline void sched_profile_dump(FILE *out) {
+    (void)out;
+}
+
+static inline void sched_profile_reset(void) {
+}
+#endif // SCHED_PROFILE
+
 #endif // SCHED_SIMPLE_H_INCLUDED
@@ -0,0 +1,84 @@
+/* Copyright (C) 2015 David Zanetti
+ *
+ * This file is part of libkakapo.
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include "global.h"
+#include "errors.h"
+#include "sleep.h"
+
+/* number of holds on each mode shallower than power-down */
+volatile uint8_t _sleep_holds[sleep_pdown];
+
+/* SMODE values for each of our modes */
+const uint8_t _sleep_smode[] = {
+	SLEEP_SMODE_IDLE_gc,
+	SLEEP_SMODE_PSAVE_gc,
+	SLEEP_SMODE_PDOWN_gc,
+};
+
+int sleep_hold(sleep_depth_t mode) {
+	if (mode >= sleep_pdown) {
+		return -EINVAL;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_sleep_holds[mode]++;
+	}
+	return 0;
+}
+
+int sleep_release(sleep_depth_t mode) {
+	int ret = -EINVAL;
+
+	if (mode >= sleep_pdown) {
+		return -EINVAL;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (_sleep_holds[mode]) {
+			_sleep_holds[mode]--;
+			ret = 0;
+		}
+	}
+	return ret;
+}
+
+sleep_depth_t sleep_deepest(void) {
+	sleep_depth_t mode;
+
+	/* the shallowest mode held wins */
+	for (mode = sleep_idle; mode < sleep_pdown; mode++) {
+		if (_sleep_holds[mode]) {
+			break;
+		}
+	}
+	return mode;
+}
+
+void sleep_enter(void) {
+	SLEEP.CTRL = _sleep_smode[sleep_deepest()] | SLEEP_SEN_bm;
+	/* the instruction after sei is always executed before any pending
+	 * interrupt, so we can't miss a wakeup between here and the check
+	 * made by the caller */
+	sei();
+	sleep_cpu();
+	SLEEP.CTRL = 0;
+}
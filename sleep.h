@@ -0,0 +1,86 @@
+/* Copyright (C) 2015 David Zanetti
+ *
+ * This file is part of libkakapo.
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Sleep mode selection public interface */
+
+#ifndef SLEEP_H_INCLUDED
+#define SLEEP_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \file
+ *  \brief Sleep mode selection
+ *
+ *  Drivers which need a peripheral to keep running while the CPU sleeps
+ *  hold the sleep mode they need, and release it when they stop. The
+ *  deepest mode nobody holds a shallower mode against is then used by
+ *  sleep_enter().
+ *
+ *  The USART and timer drivers hold sleep_idle while they are running,
+ *  and the RTC driver holds sleep_psave. With nothing held, the CPU goes
+ *  to power-down, and only pin changes and the WDT can wake it.
+ */
+
+/** \brief Sleep modes, from shallowest to deepest */
+typedef enum {
+	sleep_idle = 0, /**< CPU stops, peripherals keep running */
+	sleep_psave, /**< Only the RTC and asynchronous wakeups keep running */
+	sleep_pdown, /**< Only asynchronous wakeups, eg pin change or WDT */
+} sleep_depth_t;
+
+/** \brief Prevent sleeping any deeper than the given mode
+ *
+ *  Holds are counted, each must be matched by a call to sleep_release().
+ *
+ *  \param mode Deepest mode which is still allowed
+ *  \return 0 on success, errors.h otherwise
+ */
+int sleep_hold(sleep_depth_t mode);
+
+/** \brief Release a hold taken by sleep_hold()
+ *
+ *  \param mode Mode given to sleep_hold()
+ *  \return 0 on success, -EINVAL if the mode is not held
+ */
+int sleep_release(sleep_depth_t mode);
+
+/** \brief Return the deepest sleep mode allowed right now
+ *
+ *  \return Deepest mode allowed by current holds
+ */
+sleep_depth_t sleep_deepest(void);
+
+/** \brief Sleep in the deepest allowed mode until an interrupt
+ *
+ *  This must be called with interrupts disabled, after checking there is
+ *  nothing left to do. Interrupts are enabled immediately before the
+ *  sleep instruction, so an interrupt arriving after the check still
+ *  wakes us. Returns with interrupts enabled, after the waking interrupt
+ *  has been handled.
+ */
+void sleep_enter(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SLEEP_H_INCLUDED
@@ -0,0 +1,143 @@
+/* Copyright (C) 2015 David Zanetti
+ *
+ * This file is part of libkakapo.
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stress test of the lock-free SPSC queues from queue.h
+ *
+ * A producer thread pushes a running sequence of multi-word elements and
+ * a consumer thread takes them with pop or peek/drop, chosen at random.
+ * Each element carries its sequence number twice, once inverted, so an
+ * element read before it was fully stored shows up as a mismatch, and a
+ * lost or repeated one as a sequence error. The fill level is checked to
+ * stay in range, and the smallest queue has room for one element only.
+ *
+ * Usage: queue_stress [elements per queue]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "queue.h"
+
+typedef struct {
+	uint32_t seq;
+	uint32_t pad[2];
+	uint32_t check; /* ~seq */
+} elem_t;
+
+QUEUE_TYPE(eq, elem_t)
+
+QUEUE_DEFINE(eq, q2, 2);
+QUEUE_DEFINE(eq, q16, 16);
+QUEUE_DEFINE(eq, q256, 256);
+
+static unsigned long total = 5000000UL;
+
+/* cheap per-thread random numbers, so the threads don't share state */
+static inline uint32_t rnd(uint32_t *seed) {
+	*seed = *seed * 1103515245UL + 12345UL;
+	return *seed >> 16;
+}
+
+static void *produce(void *arg) {
+	eq_t *q = arg;
+	unsigned long seq = 0;
+	elem_t e;
+
+	while (seq < total) {
+		e.seq = seq;
+		e.pad[0] = e.pad[1] = seq * 3;
+		e.check = ~(uint32_t)seq;
+		if (eq_push(q, &e)) {
+			seq++;
+		} else {
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+static int stress(eq_t *q, const char *name) {
+	pthread_t producer;
+	unsigned long seq = 0;
+	uint32_t seed = 2;
+	elem_t e, *p;
+	uint8_t used;
+	int got;
+
+	if (pthread_create(&producer, NULL, &produce, q)) {
+		return 1;
+	}
+	while (seq < total) {
+		used = eq_used(q);
+		if (used > q->mask) {
+			printf("%s: fill level %u out of range\n", name, used);
+			return 1;
+		}
+		if (rnd(&seed) & 1) {
+			got = eq_pop(q, &e);
+		} else {
+			p = eq_peek(q);
+			got = p != NULL;
+			if (got) {
+				e = *p;
+				eq_drop(q);
+			}
+		}
+		if (!got) {
+			sched_yield();
+			continue;
+		}
+		if (e.seq != (uint32_t)seq || e.check != ~(uint32_t)seq ||
+			e.pad[0] != (uint32_t)seq * 3 || e.pad[1] != (uint32_t)seq * 3) {
+			printf("%s: element %lu was %lu/%08lx, expected %lu\n", name,
+				seq, (unsigned long)e.seq, (unsigned long)e.check, seq);
+			return 1;
+		}
+		seq++;
+	}
+	pthread_join(producer, NULL);
+	if (!eq_empty(q)) {
+		printf("%s: %u elements left over\n", name, eq_used(q));
+		return 1;
+	}
+	printf("%s: %lu elements in order\n", name, seq);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int fail = 0;
+
+	if (argc > 1) {
+		total = strtoul(argv[1], NULL, 0);
+	}
+
+	if (QUEUE_INIT(eq, q2) || QUEUE_INIT(eq, q16) || QUEUE_INIT(eq, q256)) {
+		printf("init failed\n");
+		return 1;
+	}
+
+	fail |= stress(&q2, "queue 2");
+	fail |= stress(&q16, "queue 16");
+	fail |= stress(&q256, "queue 256");
+
+	return fail;
+}
@@ -0,0 +1,152 @@
+/* Copyright (C) 2015 David Zanetti
+ *
+ * This file is part of libkakapo.
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host throughput benchmark of the ringbuffer transfer paths
+ *
+ * Moves the same data through a ring with the per-character functions,
+ * the block functions and the peek/commit pair, filling and draining in
+ * chunks of a few sizes, and reports bytes/sec for each. The absolute
+ * numbers say little about an XMEGA, but the ratio between the per-char
+ * and block paths is what the block API is for.
+ *
+ * Usage: ring_bench [bytes per run]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ringbuffer.h"
+#include "ring16.h"
+
+static unsigned long total = 50000000UL;
+/* keeps the compiler from discarding what was read */
+static volatile char sink;
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* generate the three transfer loops and a runner for one flavour */
+#define RING_BENCH(type, fn) \
+static void fn##by_char(type *ring, uint16_t chunk) { \
+	unsigned long done; \
+	uint16_t k; \
+	\
+	for (done = 0; done < total; done += chunk) { \
+		for (k = 0; k < chunk; k++) { \
+			fn##write(ring, (char)k); \
+		} \
+		for (k = 0; k < chunk; k++) { \
+			sink = fn##read(ring); \
+		} \
+	} \
+} \
+\
+static void fn##by_block(type *ring, uint16_t chunk) { \
+	static char in[4096], out[4096]; \
+	unsigned long done; \
+	\
+	for (done = 0; done < total; done += chunk) { \
+		fn##write_block(ring, in, chunk); \
+		fn##read_block(ring, out, chunk); \
+		sink = out[0]; \
+	} \
+} \
+\
+static void fn##by_peek(type *ring, uint16_t chunk) { \
+	static char in[4096], out[4096]; \
+	unsigned long done; \
+	uint16_t len, left; \
+	char *ptr; \
+	\
+	for (done = 0; done < total; done += chunk) { \
+		/* at most two segments each way around the wrap */ \
+		for (left = chunk; left; left -= len) { \
+			len = fn##peek_write(ring, &ptr); \
+			len = len < left ? len : left; \
+			memcpy(ptr, in, len); \
+			fn##commit_write(ring, len); \
+		} \
+		for (left = chunk; left; left -= len) { \
+			len = fn##peek_read(ring, &ptr); \
+			len = len < left ? len : left; \
+			memcpy(out, ptr, len); \
+			fn##commit_read(ring, len); \
+		} \
+		sink = out[0]; \
+	} \
+} \
+\
+static void fn##bench(type *ring, const char *name, uint16_t chunk) { \
+	static const struct { \
+		const char *name; \
+		void (*run)(type *, uint16_t); \
+	} paths[] = { \
+		{"char", &fn##by_char}, \
+		{"block", &fn##by_block}, \
+		{"peek", &fn##by_peek}, \
+	}; \
+	double start, rate[3]; \
+	uint8_t p; \
+	\
+	for (p = 0; p < 3; p++) { \
+		fn##reset(ring); \
+		start = now(); \
+		paths[p].run(ring, chunk); \
+		rate[p] = total / (now() - start); \
+	} \
+	printf("%-16s %5u %10.1f %10.1f %10.1f %9.1fx\n", name, chunk, \
+		rate[0] / 1e6, rate[1] / 1e6, rate[2] / 1e6, rate[1] / rate[0]); \
+}
+
+RING_BENCH(ringbuffer_t, ring_)
+RING_BENCH(ring16_t, ring16_)
+
+int main(int argc, char *argv[]) {
+	static char b256[256], b4k[4096];
+	static const uint16_t chunks[] = {8, 64, 200};
+	ringbuffer_t r256;
+	ring16_t r4k;
+	uint8_t c;
+
+	if (argc > 1) {
+		total = strtoul(argv[1], NULL, 0);
+	}
+
+	ring_init_static(&r256, b256, sizeof(b256), RING_F_NONE);
+	ring16_init_static(&r4k, b4k, sizeof(b4k), RING_F_NONE);
+
+	printf("%-16s %5s %10s %10s %10s %10s\n", "ring", "chunk", "char MB/s",
+		"block MB/s", "peek MB/s", "block/char");
+	for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+		ring_bench(&r256, "ringbuffer_t 256", chunks[c]);
+	}
+	for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+		ring16_bench(&r4k, "ring16_t 4096", chunks[c]);
+	}
+	ring16_bench(&r4k, "ring16_t 4096", 2000);
+
+	return 0;
+}
@@ -0,0 +1,249 @@
+/* Copyright (C) 2015 David Zanetti
+ *
+ * This file is part of libkakapo.
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stress test of the lock-free SPSC ringbuffer protocol
+ *
+ * A producer thread and a consumer thread hammer one ring through the
+ * safe single character, block and peek/commit functions, chosen at
+ * random on both sides. The producer writes a running byte sequence and
+ * the consumer checks every byte arrives once, in order. Any torn index
+ * update or misordered publish shows up as a sequence error or a fill
+ * level out of range. Overwriting rings are checked separately, from one
+ * thread, since their producer moves the tail too.
+ *
+ * Usage: ring_stress [bytes per ring]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "ringbuffer.h"
+#include "ring16.h"
+
+static unsigned long total = 20000000UL;
+
+/* cheap per-thread random numbers, so the threads don't share state */
+static inline uint32_t rnd(uint32_t *seed) {
+	*seed = *seed * 1103515245UL + 12345UL;
+	return *seed >> 16;
+}
+
+/* generate a producer, consumer and runner for one ringbuffer flavour */
+#define RING_STRESS(type, fn) \
+/* single character writes refused, which are the only ones counted as \
+ * dropped, as the block ones are left with the caller */ \
+static unsigned long fn##refused; \
+\
+static void *fn##produce(void *arg) { \
+	type *ring = arg; \
+	unsigned long seq = 0; \
+	uint32_t seed = 1; \
+	char buf[300], *ptr; \
+	uint16_t n, k; \
+	\
+	while (seq < total) { \
+		switch (rnd(&seed) % 3) { \
+			case 0: \
+				if (fn##write(ring, (char)seq)) { \
+					seq++; \
+				} else { \
+					fn##refused++; \
+				} \
+				break; \
+			case 1: \
+				n = rnd(&seed) % sizeof(buf); \
+				if (n > total - seq) { \
+					n = total - seq; \
+				} \
+				for (k = 0; k < n; k++) { \
+					buf[k] = (char)(seq + k); \
+				} \
+				seq += fn##write_block(ring, buf, n); \
+				break; \
+			default: \
+				n = fn##peek_write(ring, &ptr); \
+				if (n > total - seq) { \
+					n = total - seq; \
+				} \
+				for (k = 0; k < n; k++) { \
+					ptr[k] = (char)(seq + k); \
+				} \
+				fn##commit_write(ring, n); \
+				seq += n; \
+				break; \
+		} \
+		if (!fn##free(ring)) { \
+			sched_yield(); \
+		} \
+	} \
+	return NULL; \
+} \
+\
+static int fn##stress(type *ring, const char *name) { \
+	pthread_t producer; \
+	unsigned long seq = 0; \
+	uint32_t seed = 2; \
+	char buf[300], *ptr; \
+	uint16_t n, k, used; \
+	\
+	fn##refused = 0; \
+	fn##dropped_reset(ring); \
+	if (pthread_create(&producer, NULL, &fn##produce, ring)) { \
+		return 1; \
+	} \
+	while (seq < total) { \
+		used = fn##used(ring); \
+		if (used > ring->mask) { \
+			printf("%s: fill level %u out of range\n", name, used); \
+			return 1; \
+		} \
+		switch (rnd(&seed) % 3) { \
+			case 0: \
+				if (fn##readable(ring)) { \
+					buf[0] = fn##read(ring); \
+					n = 1; \
+				} else { \
+					n = 0; \
+				} \
+				break; \
+			case 1: \
+				n = fn##read_block(ring, buf, rnd(&seed) % sizeof(buf)); \
+				break; \
+			default: \
+				n = fn##peek_read(ring, &ptr); \
+				memcpy(buf, ptr, n > sizeof(buf) ? sizeof(buf) : n); \
+				if (n > sizeof(buf)) { \
+					n = sizeof(buf); \
+				} \
+				fn##commit_read(ring, n); \
+				break; \
+		} \
+		for (k = 0; k < n; k++) { \
+			if (buf[k] != (char)(seq + k)) { \
+				printf("%s: byte %lu was %02x, expected %02x\n", name, \
+					seq + k, (uint8_t)buf[k], (uint8_t)(seq + k)); \
+				return 1; \
+			} \
+		} \
+		seq += n; \
+		if (!n) { \
+			sched_yield(); \
+		} \
+	} \
+	pthread_join(producer, NULL); \
+	if (fn##readable(ring)) { \
+		printf("%s: %u bytes left over\n", name, fn##used(ring)); \
+		return 1; \
+	} \
+	if (fn##dropped(ring) != (uint16_t)fn##refused) { \
+		printf("%s: %u bytes counted as dropped, %lu refused\n", name, \
+			fn##dropped(ring), fn##refused); \
+		return 1; \
+	} \
+	printf("%s: %lu bytes in order, peak %u\n", name, seq, fn##peak(ring)); \
+	return 0; \
+} \
+\
+/* overwriting rings are not SPSC, so alternate bursts of writes with \
+ * reads instead. What is read must be the newest part of the sequence, \
+ * and every byte written is either still held or counted dropped */ \
+static int fn##overwrite(type *ring, const char *name) { \
+	unsigned long seq = 0, start, rounds; \
+	uint32_t seed = 3; \
+	char buf[600]; \
+	uint16_t n, k, held, used; \
+	uint8_t w; \
+	\
+	for (rounds = 0; rounds < total / 256; rounds++) { \
+		fn##dropped_reset(ring); \
+		start = seq; \
+		held = fn##used(ring); \
+		for (w = rnd(&seed) % 4; w; w--) { \
+			if (rnd(&seed) & 1) { \
+				fn##write(ring, (char)seq++); \
+				continue; \
+			} \
+			/* up to twice the ring, so some blocks skip their start */ \
+			n = rnd(&seed) % (2 * ring->mask + 3); \
+			if (n > sizeof(buf)) { \
+				n = sizeof(buf); \
+			} \
+			for (k = 0; k < n; k++) { \
+				buf[k] = (char)(seq + k); \
+			} \
+			if (fn##write_block(ring, buf, n) != n) { \
+				printf("%s: short overwriting block write\n", name); \
+				return 1; \
+			} \
+			seq += n; \
+		} \
+		used = fn##used(ring); \
+		if (used > ring->mask || \
+			seq - start + held != (unsigned long)used + fn##dropped(ring)) { \
+			printf("%s: %lu written, %u held, %u dropped\n", name, \
+				seq - start + held, used, fn##dropped(ring)); \
+			return 1; \
+		} \
+		n = rnd(&seed) % (used + 1); \
+		n = fn##read_block(ring, buf, n > sizeof(buf) ? sizeof(buf) : n); \
+		for (k = 0; k < n; k++) { \
+			if (buf[k] != (char)(seq - used + k)) { \
+				printf("%s: byte %lu was %02x, expected %02x\n", name, \
+					seq - used + k, (uint8_t)buf[k], \
+					(uint8_t)(seq - used + k)); \
+				return 1; \
+			} \
+		} \
+	} \
+	printf("%s: %lu bytes overwriting, newest kept\n", name, seq); \
+	return 0; \
+}
+
+RING_STRESS(ringbuffer_t, ring_)
+RING_STRESS(ring16_t, ring16_)
+
+int main(int argc, char *argv[]) {
+	static char b64[64], b256[256], b4k[4096];
+	ringbuffer_t r64, r256;
+	ring16_t r4k, r256w;
+	int fail = 0;
+
+	if (argc > 1) {
+		total = strtoul(argv[1], NULL, 0);
+	}
+
+	ring_init_static(&r64, b64, sizeof(b64), RING_F_NONE);
+	ring_init_static(&r256, b256, sizeof(b256), RING_F_NONE);
+	ring16_init_static(&r4k, b4k, sizeof(b4k), RING_F_NONE);
+
+	fail |= ring_stress(&r64, "ringbuffer_t 64");
+	fail |= ring_stress(&r256, "ringbuffer_t 256");
+	fail |= ring16_stress(&r4k, "ring16_t 4096");
+
+	ring_init_static(&r64, b64, sizeof(b64), RING_F_OVERWRITE);
+	ring16_init_static(&r256w, b256, sizeof(b256), RING_F_OVERWRITE);
+	fail |= ring_overwrite(&r64, "ringbuffer_t 64");
+	fail |= ring16_overwrite(&r256w, "ring16_t 256");
+
+	return fail;
+}
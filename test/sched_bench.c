@@ -0,0 +1,268 @@
+/* Copyright (C) 2015 David Zanetti
+ *
+ * This file is part of libkakapo.
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host benchmark of the sched_simple run queue
+ *
+ * Times enqueue/dequeue cycles of empty tasks through the multi-level
+ * run queue, against a copy of the two-level deque it replaced
+ * (_runq_push_start for sched_now, _runq_push_end for sched_later).
+ * Each pattern is run through both:
+ *
+ *  - pair: queue one sched_now and one sched_later task, run both
+ *  - burst: queue a full run queue across the levels, run them all
+ *
+ * The deque only has two levels, so in the burst it gets the same tasks
+ * split between its head and tail. Interrupts are no-ops on the host, so
+ * this compares the queue work only, not the time spent with them off.
+ *
+ * Usage: sched_bench [cycles]
+ */
+
+#include <avr/io.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <util/atomic.h>
+#include "errors.h"
+#include "sched_simple.h"
+
+#define QLEN 16
+
+PMIC_t PMIC;
+
+static unsigned long cycles = 2000000UL;
+static volatile uint32_t calls;
+
+/* the benchmark never idles */
+void sleep_enter(void) {
+}
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void nop_task(void *data) {
+	calls++;
+}
+
+/* The deque sched_simple used before the priority levels, without the
+ * debug output. Two fixes so it runs at all, neither changes the work
+ * done per task: the pointers wrap at _runq + qlen, so it needs a spare
+ * slot, and an empty queue has end one behind start, not equal to it.
+ */
+
+typedef struct {
+	void (*fn)(void *);
+	void *data;
+} old_task_t;
+
+static old_task_t *_runq;
+static volatile old_task_t *_runq_start;
+static volatile old_task_t *_runq_end;
+static volatile uint8_t _runq_len;
+static volatile uint8_t _runq_entries;
+
+static int old_init(uint8_t qlen) {
+	_runq = malloc(sizeof(old_task_t)*(qlen + 1));
+	if (!_runq) {
+		return -ENOMEM;
+	}
+	_runq_start = _runq + 1;
+	_runq_end = _runq;
+	_runq_entries = 0;
+	_runq_len = qlen;
+	memset(_runq,0,sizeof(old_task_t)*(qlen + 1));
+	return 0;
+}
+
+static inline void _runq_back(old_task_t **p) {
+	if (*p == _runq) {
+		(*p) = _runq + _runq_len;
+	} else {
+		(*p)--;
+	}
+}
+
+static inline void _runq_forward(old_task_t **p) {
+	if (*p == _runq + _runq_len) {
+		(*p) = _runq;
+	} else {
+		(*p)++;
+	}
+}
+
+static int _runq_push_start(void (*fn)(void *),void *data) {
+	if (_runq_entries == _runq_len) {
+		return -ENOMEM;
+	}
+	_runq_back((old_task_t **)&_runq_start);
+	_runq_entries++;
+	_runq_start->fn = fn;
+	_runq_start->data = data;
+	return 0;
+}
+
+static int _runq_push_end(void (*fn)(void *),void *data) {
+	if (_runq_entries == _runq_len) {
+		return -ENOMEM;
+	}
+	_runq_forward((old_task_t **)&_runq_end);
+	_runq_entries++;
+	_runq_end->fn = fn;
+	_runq_end->data = data;
+	return 0;
+}
+
+static old_task_t *_runq_pop_start(void) {
+	old_task_t *ret;
+
+	if (!_runq_entries) {
+		return NULL;
+	}
+	ret = (old_task_t *)_runq_start;
+	_runq_forward((old_task_t **)&_runq_start);
+	_runq_entries--;
+	return ret;
+}
+
+static int old_run(void (*fn)(void *),void *data,sched_prio_t prio) {
+	switch (prio) {
+		case sched_later:
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				return _runq_push_end(fn,data);
+			}
+			break;
+		case sched_now:
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				return _runq_push_start(fn,data);
+			}
+			break;
+		default:
+			break;
+	}
+	return -EINVAL;
+}
+
+static void old_simple(void) {
+	old_task_t task, *next;
+
+	while (1) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			next = _runq_pop_start();
+			if (next) {
+				task = *next;
+			}
+		}
+		if (!next) {
+			break;
+		}
+		(task.fn)(task.data);
+	}
+}
+
+/* the patterns, for either queue */
+
+typedef struct {
+	const char *name;
+	int (*run)(void (*)(void *), void *, sched_prio_t);
+	void (*simple)(void);
+	uint8_t levels; /* number of levels it can tell apart */
+} queue_t;
+
+static void pair(const queue_t *q) {
+	unsigned long n;
+
+	for (n = 0; n < cycles; n++) {
+		q->run(&nop_task, NULL, sched_later);
+		q->run(&nop_task, NULL, sched_now);
+		q->simple();
+	}
+}
+
+static void burst(const queue_t *q) {
+	unsigned long n;
+	uint8_t k;
+
+	for (n = 0; n < cycles; n += QLEN) {
+		for (k = 0; k < QLEN; k++) {
+			/* every level on the new queue, head or tail on the old */
+			if (q->levels == 2) {
+				q->run(&nop_task, NULL, (k & 1) ? sched_later : sched_now);
+			} else {
+				q->run(&nop_task, NULL, k & 7);
+			}
+		}
+		q->simple();
+	}
+}
+
+static double bench(const queue_t *q, void (*pattern)(const queue_t *),
+	uint8_t tasks) {
+	double start;
+	uint32_t expect;
+
+	calls = 0;
+	start = now();
+	pattern(q);
+	start = (now() - start) / (cycles * (tasks == 2 ? 2 : 1)) * 1e9;
+	/* burst rounds up to a whole run queue */
+	expect = tasks == 2 ? cycles * 2 : (cycles + QLEN - 1) / QLEN * QLEN;
+	if (calls != expect) {
+		printf("%s: ran %u tasks, expected %u\n", q->name, calls, expect);
+		exit(1);
+	}
+	return start;
+}
+
+int main(int argc, char *argv[]) {
+	static const queue_t queues[] = {
+		{"levels", &sched_run, &sched_simple, 8},
+		{"deque", &old_run, &old_simple, 2},
+	};
+	double t[2][2];
+	uint8_t q;
+
+	if (argc > 1) {
+		cycles = strtoul(argv[1], NULL, 0);
+	}
+
+	if (sched_simple_init(QLEN) || old_init(QLEN)) {
+		printf("init failed\n");
+		return 1;
+	}
+
+	for (q = 0; q < 2; q++) {
+		t[q][0] = bench(&queues[q], &pair, 2);
+		t[q][1] = bench(&queues[q], &burst, QLEN);
+	}
+
+	printf("ns per task enqueue+dequeue  %10s %10s\n", "pair", "burst");
+	for (q = 0; q < 2; q++) {
+		printf("%-28s %10.1f %10.1f\n", queues[q].name, t[q][0], t[q][1]);
+	}
+	printf("%-28s %9.2fx %9.2fx\n", "levels / deque",
+		t[0][0] / t[1][0], t[0][1] / t[1][1]);
+
+	return 0;
+}
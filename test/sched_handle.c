@@ -0,0 +1,144 @@
+/* Copyright (C) 2015 David Zanetti
+ *
+ * This file is part of libkakapo.
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host test of sched_simple handle generations
+ *
+ * Keeps the first handle given out for a run queue slot, an interrupt
+ * level token and a timer, then reuses each of them as many times as the
+ * 15 bit generation can tell apart, far past where the old 5 and 7 bit
+ * ones wrapped. Every time round, the stale handle must be refused while
+ * the new task or timer is pending, and the new one must still run.
+ * Interrupt levels are faked by setting PMIC.STATUS.
+ *
+ * Usage: sched_handle
+ */
+
+#include <avr/io.h>
+#include <stdio.h>
+#include <util/atomic.h>
+#include "errors.h"
+#include "sched_simple.h"
+
+/* one short of a trip around the 15 bit generation, the next reuse
+ * would be given the stale handle's generation again */
+#define REUSES 0x7fffUL
+
+PMIC_t PMIC;
+
+static unsigned long calls;
+
+/* nothing here idles */
+void sleep_enter(void) {
+}
+
+static void count_task(void *data) {
+	calls++;
+}
+
+/* reuse a handle source, get() adds a task and returns its handle, run()
+ * runs it, and cancel() is tried on the stale handle in between */
+static int reuse(const char *name, unsigned long times,
+	sched_handle_t (*get)(void), void (*run)(void),
+	int (*cancel)(sched_handle_t)) {
+	sched_handle_t old, h;
+	unsigned long n, same = 0;
+	int ret;
+
+	old = get();
+	if (old < 0) {
+		printf("%s: first add failed, %ld\n", name, (long)old);
+		return 1;
+	}
+	run();
+	calls = 0;
+
+	for (n = 0; n < times; n++) {
+		h = get();
+		if (h < 0) {
+			printf("%s: add %lu failed, %ld\n", name, n, (long)h);
+			return 1;
+		}
+		if ((h & 0xff) == (old & 0xff)) {
+			same++;
+		}
+		ret = cancel(old);
+		if (ret != -EINVAL) {
+			printf("%s: stale handle %lx cancelled %lx on reuse %lu, %d\n",
+				name, (long)old, (long)h, n, ret);
+			return 1;
+		}
+		run();
+		if (calls != n + 1) {
+			printf("%s: task %lu did not run\n", name, n);
+			return 1;
+		}
+	}
+	if (same < REUSES) {
+		printf("%s: index only reused %lu times\n", name, same);
+		return 1;
+	}
+	printf("%s: stale handle refused over %lu reuses\n", name, same);
+	return 0;
+}
+
+static sched_handle_t slot_get(void) {
+	return sched_run_handle(&count_task, NULL, sched_now);
+}
+
+static sched_handle_t token_get(void) {
+	sched_handle_t h;
+
+	PMIC.STATUS = PMIC_LOLVLEX_bm;
+	h = sched_run_handle(&count_task, NULL, sched_now);
+	PMIC.STATUS = 0;
+	return h;
+}
+
+static void task_run(void) {
+	sched_simple();
+}
+
+static sched_handle_t timer_get(void) {
+	return sched_run_after(&count_task, NULL, 1);
+}
+
+static void timer_run(void) {
+	sched_tick();
+	sched_simple();
+}
+
+int main(int argc, char *argv[]) {
+	int fail = 0;
+
+	/* one timer, so it is always the one reused */
+	if (sched_simple_init(4) || sched_timer_init(1)) {
+		printf("init failed\n");
+		return 1;
+	}
+
+	fail |= reuse("slot", REUSES, &slot_get, &task_run, &sched_cancel);
+	/* tokens are handed out in turn, so go round all of them */
+	fail |= reuse("token", REUSES * (4 + SCHED_INGRESS - 1), &token_get,
+		&task_run, &sched_cancel);
+	fail |= reuse("timer", REUSES, &timer_get, &timer_run,
+		&sched_timer_cancel);
+
+	return fail;
+}
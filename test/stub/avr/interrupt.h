@@ -0,0 +1,16 @@
+/* Host stand-in for <avr/interrupt.h>
+ *
+ * The real header pulls in <avr/io.h> and with it <stdint.h>, which the
+ * sources rely on.
+ */
+
+#ifndef STUB_AVR_INTERRUPT_H
+#define STUB_AVR_INTERRUPT_H
+
+#include <stdint.h>
+
+#define ISR(vect) void vect(void); void vect(void)
+#define cli() do {} while (0)
+#define sei() do {} while (0)
+
+#endif // STUB_AVR_INTERRUPT_H
@@ -0,0 +1,24 @@
+/* Host stand-in for the parts of <avr/io.h> the host tests need */
+
+#ifndef STUB_AVR_IO_H
+#define STUB_AVR_IO_H
+
+#include <stdint.h>
+
+typedef volatile uint8_t register8_t;
+
+typedef struct {
+	register8_t STATUS;
+	register8_t INTPRI;
+	register8_t CTRL;
+} PMIC_t;
+
+/* defined by each test, so a test can pretend to be in an ISR by setting
+ * PMIC.STATUS */
+extern PMIC_t PMIC;
+
+#define PMIC_LOLVLEX_bm 0x01
+#define PMIC_MEDLVLEX_bm 0x02
+#define PMIC_HILVLEX_bm 0x04
+
+#endif // STUB_AVR_IO_H
@@ -0,0 +1,14 @@
+/* Host stand-in for <avr/pgmspace.h>, everything is in RAM */
+
+#ifndef STUB_AVR_PGMSPACE_H
+#define STUB_AVR_PGMSPACE_H
+
+#include <stdio.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define fprintf_P fprintf
+#define printf_P printf
+
+#endif // STUB_AVR_PGMSPACE_H
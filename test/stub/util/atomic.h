@@ -0,0 +1,16 @@
+/* Host stand-in for <util/atomic.h>
+ *
+ * There are no interrupts on the host, and the stress tests only share
+ * rings between threads through the lock-free SPSC paths. The only
+ * atomic blocks those reach are the ring16_t index accesses, and aligned
+ * 16 bit loads and stores are atomic on the host already.
+ */
+
+#ifndef STUB_UTIL_ATOMIC_H
+#define STUB_UTIL_ATOMIC_H
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 0
+#define ATOMIC_BLOCK(type) for (int _atomic_once = 1; _atomic_once; _atomic_once = 0)
+
+#endif // STUB_UTIL_ATOMIC_H
@@ -32,6 +32,7 @@
 #include <util/delay.h>
 
 #include "timer.h"
+#include "sleep.h"
 #include "errors.h"
 
 typedef struct {
@@ -284,6 +285,8 @@ int timer_init(uint8_t timernum, timer_pwm_t mode, uint16_t period,
 
 /* Clock source setting */
 int timer_clk(uint8_t timernum, timer_clk_src_t clk) {
+	uint8_t was;
+
 	if (timernum >= MAX_TIMERS || !timers[timernum]) {
 		return -ENODEV;
 	}
@@ -292,22 +295,26 @@ int timer_clk(uint8_t timernum, timer_clk_src_t clk) {
 	switch (timers[timernum]->type) {
 #ifdef _HAVE_TIMER_TYPE0
 		case 0:
+			was = timers[timernum]->hw.hw0->CTRLA;
 			timers[timernum]->hw.hw0->CTRLA = clk;
 			break;
 #endif // _HAVE_TIMER_TYPE0
 #ifdef _HAVE_TIMER_TYPE1
 		case 1:
+			was = timers[timernum]->hw.hw1->CTRLA;
 			timers[timernum]->hw.hw1->CTRLA = clk; /* cheating! */
 			break;
 #endif // _HAVE_TIMER_TYPE1
         /* fixme: type 2 timers */
 #ifdef _HAVE_TIMER_TYPE4
         case 4:
+        	was = timers[timernum]->hw.hw4->CTRLA;
         	timers[timernum]->hw.hw4->CTRLA = clk; /* cheating! */
 			break;
 #endif // _HAVE_TIMER_TYPE4
 #ifdef _HAVE_TIMER_TYPE5
         case 5:
+        	was = timers[timernum]->hw.hw5->CTRLA;
         	timers[timernum]->hw.hw5->CTRLA = clk; /* cheating! */
 			break;
 #endif // _HAVE_TIMER_TYPE5
@@ -315,6 +322,13 @@ int timer_clk(uint8_t timernum, timer_clk_src_t clk) {
 			return EINVAL;
 	}
 
+	/* a running timer is stopped by any sleep mode deeper than idle */
+	if (clk && !(was & TC0_CLKSEL_gm)) {
+		sleep_hold(sleep_idle);
+	} else if (!clk && (was & TC0_CLKSEL_gm)) {
+		sleep_release(sleep_idle);
+	}
+
 	return 0;
 }
 
@@ -304,7 +304,8 @@ int timer_init(timer_portname_t timer, timer_pwm_t mode, uint16_t period,
 /** \brief Clock the timer from the given source
  *
  *  Note: this starts the timer running for any value other than
- *  timer_off.
+ *  timer_off. While running, the timer prevents sleep_enter() from going
+ *  deeper than sleep_idle.
  *
  *  \param timernum Number of the timer
  *  \param clk Clock source/divider
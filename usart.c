@@ -27,12 +27,15 @@
 #include <avr/interrupt.h>
 #include <util/atomic.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "global.h"
 #include <util/delay.h>
 
 #include "usart.h"
+#include "usart_impl.h"
 #include "ringbuffer.h"
+#include "sleep.h"
 #include "errors.h"
 
 /** \file
@@ -57,21 +60,26 @@
  *  implemented, as all code is generic
  */
 
-/* hw access, buffers, and metadata about a usart port */
 
-/** \struct usart_port_t
- *  \brief  Contains the abstraction of a hardware port
- */
-typedef struct {
-	USART_t *hw; /**< USART hardware IO registers */
-	ringbuffer_t *txring; /**< TX ringbuffer */
-	ringbuffer_t *rxring; /**< RX ringbuffer */
-	uint8_t isr_level; /**< Level to run/restore interrupts at */
-	uint8_t features; /**< Capabilities of the port, see U_FEAT_ */
-	void (*rx_fn)(uint8_t); /**< Callback function for RX */
-} usart_port_t;
+#ifdef USART_DMA_TX
+#ifndef DMA
+#error "USART_DMA_TX requires a part with a DMA controller"
+#endif
+
+#define _DMA_IDLE 0 /**< DMA channel is free */
+#define _DMA_RING 1 /**< DMA channel is sending a block of the TX ring */
+#define _DMA_BUF 2 /**< DMA channel is sending a caller buffer */
+#define _DMA_HELD 3 /**< Caller buffer waiting for CTS, channel is free */
+
+#define USART_DMA_CHANNELS 4 /**< Number of DMA channels in the controller */
+
+/** \brief Ports using each DMA channel, for the completion ISRs */
+usart_port_t *dma_ports[USART_DMA_CHANNELS] = {0,0,0,0};
+#endif // USART_DMA_TX
 
 #define USART_RX_PULLUP /**< Should we force RX pin to have input pull-up */
+#define USART_ECHO_CHUNK 16 /**< Most bytes copied with interrupts off when
+	echo is on */
 
 usart_port_t *ports[MAX_PORTS] = USART_PORT_INIT; /**< USART port abstractions */
 
@@ -90,11 +98,82 @@ void _usart_tx_isr(usart_port_t *port);
  */
 void _usart_rx_isr(usart_port_t *port);
 
+/** \brief Account for a received character in the current frame
+ *  \param port Port abstraction this event applies to
+ *  \param s Character received
+ *  \param stored 1 if it was stored in the RX ring, 0 if it was dropped
+ */
+void _usart_frame_rx(usart_port_t *port, char s, uint8_t stored);
+
+/** \brief Take the length of the current frame, and start a new one
+ *
+ *  THIS MUST BE CALLED WITH INTERRUPTS OFF
+ *
+ *  \param port Port abstraction this event applies to
+ *  \return Number of characters in the frame
+ */
+uint16_t _usart_frame_take(usart_port_t *port);
+
+/** \brief Hand a frame to the frame callback, if it has any characters
+ *  \param port Port abstraction this event applies to
+ *  \param len Length returned by _usart_frame_take()
+ */
+void _usart_frame_end(usart_port_t *port, uint16_t len);
+
 /** \brief Start TX processing on the given port
  *  \param port Port abstraction this event applies to
  */
 void _usart_tx_run(usart_port_t *port);
 
+#ifdef USART_FLOW
+/** \brief Check the far end will accept characters
+ *  \param port Port abstraction this event applies to
+ *  \return 1 if CTS is asserted or not used, 0 otherwise
+ */
+static inline uint8_t _usart_cts(usart_port_t *port) {
+	return (!port->cts || !(port->cts->IN & port->cts_bm));
+}
+
+/** \brief Deassert RTS, as the RX ring fills
+ *  \param port Port abstraction this event applies to
+ */
+void _usart_rts_stop(usart_port_t *port);
+
+/** \brief Assert RTS, as the RX ring drains
+ *  \param port Port abstraction this event applies to
+ */
+void _usart_rts_go(usart_port_t *port);
+#endif // USART_FLOW
+
+#ifdef USART_DMA_TX
+/** \brief Start the DMA channel on a held caller buffer, or else the next
+ *  contiguous block of the TX ring
+ *
+ *  Does nothing if the channel is already busy, CTS is not asserted or
+ *  there is nothing to send. Must be called with interrupts disabled.
+ *
+ *  \param port Port abstraction this event applies to
+ */
+void _usart_dma_next(usart_port_t *port);
+
+/** \brief Handle a DMA transaction complete interrupt for the given port
+ *  \param port Port abstraction this event applies to
+ */
+void _usart_dma_isr(usart_port_t *port);
+
+#ifdef USART_FLOW
+/** \brief Stop the DMA channel part way through a block when CTS goes high
+ *
+ *  What has gone out is accounted for, the rest of a ring block stays in
+ *  the ring and the rest of a caller buffer is held, both to be restarted
+ *  by _usart_dma_next(). Must be called with interrupts disabled.
+ *
+ *  \param port Port abstraction this event applies to
+ */
+void _usart_dma_hold(usart_port_t *port);
+#endif // USART_FLOW
+#endif // USART_DMA_TX
+
 /** \brief Put hook for stdio functions.
  *
  *  See avr-libc stdio.h documentation
@@ -115,30 +194,50 @@ void _usart_tx_isr(usart_port_t *port) {
 	if (!port) {
 		return; /* don't try to use uninitalised ports */
 	}
-	/* check to see if we have anything to send */
-	if (!ring_readable_unsafe(port->txring)) {
+	/* check to see if we have anything to send, and may send it */
+#ifdef USART_FLOW
+	if (!USART_RING(readable_unsafe)(port->txring) || !_usart_cts(port)) {
+#else
+	if (!USART_RING(readable_unsafe)(port->txring)) {
+#endif // USART_FLOW
 		/* disable the interrupt and then exit, nothing more to do */
 		port->hw->CTRLA = port->hw->CTRLA & ~(USART_DREINTLVL_gm);
 		return;
 	}
 	/* TX the waiting packet */
-	port->hw->DATA = ring_read_unsafe(port->txring);
+	port->hw->DATA = USART_RING(read_unsafe)(port->txring);
+	port->stats.tx++;
 }
 
 /* handle an RX event */
 void _usart_rx_isr(usart_port_t *port) {
 	char s;
+	uint8_t stored, status;
 
 	if (!port) {
 		return; /* don't try to use uninitalised ports */
 	}
 
+	/* error flags apply to the char in DATA, so must be read first */
+	status = port->hw->STATUS;
 	s = port->hw->DATA; /* read the char from the port */
-	ring_write_unsafe(port->rxring, s); /* if this fails we have nothing useful we can do anyway */
+	port->stats.rx++;
+	if (status & (USART_FERR_bm | USART_BUFOVF_bm | USART_PERR_bm)) {
+		if (status & USART_FERR_bm) {
+			port->stats.frame_err++;
+		}
+		if (status & USART_BUFOVF_bm) {
+			port->stats.overrun++;
+		}
+		if (status & USART_PERR_bm) {
+			port->stats.parity_err++;
+		}
+	}
+	stored = USART_RING(write_unsafe)(port->rxring, s); /* if this fails we have nothing useful we can do anyway */
 
 	if (port->features & U_FEAT_ECHO) {
-		/* fixme: does this introduce another source of ring corruption? */
-		ring_write_unsafe(port->txring,s);
+		/* this makes us a second producer on the TX ring, see usart_put() */
+		USART_RING(write_unsafe)(port->txring,s);
 		_usart_tx_run(port);
 	}
 
@@ -146,15 +245,264 @@ void _usart_rx_isr(usart_port_t *port) {
 	if (port->rx_fn) {
 		(*port->rx_fn)(s);
 	}
+
+	if (port->frame_mode != usart_frame_none) {
+		_usart_frame_rx(port, s, stored);
+	}
+}
+
+/* track where the current frame ends */
+void _usart_frame_rx(usart_port_t *port, char s, uint8_t stored) {
+	uint16_t len = 0;
+
+	/* usart_frame_tick() may run at a higher level, and these are not
+	 * updated in one instruction */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		port->frame_idle = 0;
+		/* dropped characters are not in the ring, so not in the frame */
+		if (stored) {
+			port->frame_len++;
+		}
+
+		switch (port->frame_mode) {
+			case usart_frame_delim:
+				if ((uint8_t)s == port->frame_arg) {
+					len = _usart_frame_take(port);
+				}
+				break;
+			case usart_frame_len:
+				if (port->frame_len >= port->frame_arg) {
+					len = _usart_frame_take(port);
+				}
+				break;
+			default:
+				/* idle frames are ended by usart_frame_tick() */
+				break;
+		}
+	}
+
+	_usart_frame_end(port, len);
+}
+
+uint16_t _usart_frame_take(usart_port_t *port) {
+	uint16_t len = port->frame_len;
+
+	port->frame_len = 0;
+	return len;
+}
+
+void _usart_frame_end(usart_port_t *port, uint16_t len) {
+	if (len && port->frame_fn) {
+		(*port->frame_fn)(port->rxring, len);
+	}
 }
 
 /* make the given port start TXing */
 void _usart_tx_run(usart_port_t *port) {
+#ifdef USART_FLOW
+	/* the CTS ISR will start us again */
+	if (!_usart_cts(port)) {
+		return;
+	}
+#endif // USART_FLOW
+#ifdef USART_DMA_TX
+	if (port->dma) {
+		/* may be called from the RX ISR as well as usart_put() */
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			_usart_dma_next(port);
+		}
+		return;
+	}
+#endif // USART_DMA_TX
 	/* enable interrupts for the appropriate port */
 	port->hw->CTRLA = port->hw->CTRLA | (port->isr_level & USART_DREINTLVL_gm);
 	return;
 }
 
+#ifdef USART_FLOW
+/* called by the RX ISR as the ring fills */
+void _usart_rts_stop(usart_port_t *port) {
+	if (port && port->rts) {
+		port->rts->OUTSET = port->rts_bm;
+	}
+}
+
+/* called by the reader as the ring drains */
+void _usart_rts_go(usart_port_t *port) {
+	if (port && port->rts) {
+		port->rts->OUTCLR = port->rts_bm;
+	}
+}
+
+/* RX ring watermark hooks, a pair for each port number, so the port is
+ * known from the hook rather than searched for from the RX ISR */
+#define _USART_RTS_HOOKS(n) \
+void _usart_rts_stop_##n(usart_ring_t *ring) { \
+	_usart_rts_stop(ports[n]); \
+} \
+void _usart_rts_go_##n(usart_ring_t *ring) { \
+	_usart_rts_go(ports[n]); \
+}
+
+_USART_RTS_HOOKS(0)
+_USART_RTS_HOOKS(1)
+_USART_RTS_HOOKS(2)
+_USART_RTS_HOOKS(3)
+_USART_RTS_HOOKS(4)
+#if MAX_PORTS > 5
+_USART_RTS_HOOKS(5)
+#endif
+#if MAX_PORTS > 6
+_USART_RTS_HOOKS(6)
+#endif
+#if MAX_PORTS > 7
+_USART_RTS_HOOKS(7)
+#endif
+
+/* picks the hooks for port number n in usart_flow() */
+#define _USART_RTS_CASE(n) \
+	case n: \
+		stop = &_usart_rts_stop_##n; \
+		go = &_usart_rts_go_##n; \
+		break;
+
+/* CTS changed, resume TX if it is now asserted */
+void usart_cts_isr(PORT_t *io) {
+	uint8_t n;
+
+	io->INTFLAGS = PORT_INT0IF_bm;
+	for (n = 0; n < MAX_PORTS; n++) {
+		if (!ports[n] || ports[n]->cts != io) {
+			continue;
+		}
+		if (_usart_cts(ports[n])) {
+			_usart_tx_run(ports[n]);
+#ifdef USART_DMA_TX
+		} else if (ports[n]->dma) {
+			/* the channel does not look at CTS, so stop it here */
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				_usart_dma_hold(ports[n]);
+			}
+#endif // USART_DMA_TX
+		}
+	}
+	/* otherwise pausing is left to the TX ISR, which checks CTS every
+	 * character */
+}
+#endif // USART_FLOW
+
+#ifdef USART_DMA_TX
+/* the DMA channel is the consumer of the TX ring, so it reads in blocks */
+void _usart_dma_next(usart_port_t *port) {
+	char *ptr;
+	uint16_t len;
+	uint8_t busy;
+
+	if (port->dma_busy && port->dma_busy != _DMA_HELD) {
+		return; /* the completion ISR will call us again */
+	}
+#ifdef USART_FLOW
+	/* the CTS ISR will call us again */
+	if (!_usart_cts(port)) {
+		return;
+	}
+#endif // USART_FLOW
+	if (port->dma_busy == _DMA_HELD) {
+		ptr = (char *)port->dma_buf;
+		len = port->dma_len;
+		busy = _DMA_BUF;
+	} else {
+		len = USART_RING(peek_read)(port->txring, &ptr);
+		busy = _DMA_RING;
+	}
+	if (!len) {
+		return;
+	}
+
+	port->dma->SRCADDR0 = (uint16_t)ptr & 0xff;
+	port->dma->SRCADDR1 = (uint16_t)ptr >> 8;
+	port->dma->SRCADDR2 = 0;
+	port->dma->TRFCNT = len;
+	port->dma_len = len;
+	port->dma_busy = busy;
+	port->dma->CTRLA |= DMA_CH_ENABLE_bm;
+}
+
+#ifdef USART_FLOW
+void _usart_dma_hold(usart_port_t *port) {
+	uint16_t sent;
+
+	if (port->dma_busy != _DMA_RING && port->dma_busy != _DMA_BUF) {
+		return;
+	}
+	port->dma->CTRLA &= ~(DMA_CH_ENABLE_bm);
+	/* the byte in flight finishes first */
+	while (port->dma->CTRLA & DMA_CH_ENABLE_bm);
+	if (port->dma->CTRLB & (DMA_CH_TRNIF_bm | DMA_CH_ERRIF_bm)) {
+		return; /* the block ended anyway, the DMA ISR deals with it */
+	}
+
+	sent = port->dma_len - port->dma->TRFCNT;
+	port->stats.tx += sent;
+	if (port->dma_busy == _DMA_RING) {
+		USART_RING(commit_read)(port->txring, sent);
+		port->dma_busy = _DMA_IDLE;
+	} else {
+		port->dma_buf += sent;
+		port->dma_len -= sent;
+		port->dma_busy = _DMA_HELD;
+	}
+}
+#endif // USART_FLOW
+
+/* a block has gone out, release it from the ring and send the next one */
+void _usart_dma_isr(usart_port_t *port) {
+	uint16_t sent;
+
+	if (!port) {
+		return;
+	}
+	sent = port->dma_len;
+	if (port->dma->CTRLB & DMA_CH_ERRIF_bm) {
+		/* the block was cut short, only what went out is done with. the
+		 * rest of a ring block goes in the next one, the rest of a caller
+		 * buffer is abandoned */
+		port->dma->CTRLA &= ~(DMA_CH_ENABLE_bm);
+		while (port->dma->CTRLA & DMA_CH_ENABLE_bm);
+		sent -= port->dma->TRFCNT;
+	}
+	/* flags are cleared by writing one to them */
+	port->dma->CTRLB |= (DMA_CH_TRNIF_bm | DMA_CH_ERRIF_bm);
+
+	if (port->dma_busy == _DMA_RING) {
+		USART_RING(commit_read)(port->txring, sent);
+	}
+	port->stats.tx += sent;
+	port->dma_busy = _DMA_IDLE;
+
+	/* the RX ISR may echo at a higher level */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		_usart_dma_next(port);
+	}
+}
+
+ISR(DMA_CH0_vect) {
+	_usart_dma_isr(dma_ports[0]);
+}
+
+ISR(DMA_CH1_vect) {
+	_usart_dma_isr(dma_ports[1]);
+}
+
+ISR(DMA_CH2_vect) {
+	_usart_dma_isr(dma_ports[2]);
+}
+
+ISR(DMA_CH3_vect) {
+	_usart_dma_isr(dma_ports[3]);
+}
+#endif // USART_DMA_TX
+
 /* interrupt handlers */
 #if defined(USARTC0)
 ISR(USARTC0_DRE_vect) {
@@ -254,40 +602,47 @@ ISR(USARTE0_RXC_vect) {
 /* initalise the structures and hardware */
 int usart_init(usart_portname_t portnum, uint16_t rx_size, uint16_t tx_size) {
 
-	if (ports[portnum] || portnum >= MAX_PORTS) {
+	if (portnum >= MAX_PORTS || ports[portnum]) {
 		/* refuse to re-initalise a port or one not allocatable */
 		return -ENODEV;
 	}
 
+    /* check to see length is possible */
+    if (rx_size > USART_RING_MAX || (rx_size & (rx_size-1)) ||
+        tx_size > USART_RING_MAX || (tx_size & (tx_size-1))) {
+        return -EINVAL;
+    }
+
 	/* create the metadata for the port */
 	ports[portnum] = malloc(sizeof(usart_port_t));
 	if (!ports[portnum]) {
 		return -ENOMEM;
 	}
 
-    /* check to see length is possible */
-    if (rx_size > RINGBUFFER_MAX || (rx_size & (rx_size-1)) ||
-        tx_size > RINGBUFFER_MAX || (tx_size & (tx_size-1))) {
-        return -EINVAL;
-    }
-
 	/* create two ringbuffers, one for TX and one for RX */
 
-	ports[portnum]->rxring = ring_create(rx_size);
+	ports[portnum]->rxring = USART_RING(create)(rx_size);
 	if (!ports[portnum]->rxring) {
 		free(ports[portnum]);
 		ports[portnum] = NULL;
 		return -ENOMEM;
 	}
 
-	ports[portnum]->txring = ring_create(tx_size);
+	ports[portnum]->txring = USART_RING(create)(tx_size);
 	if (!ports[portnum]->txring) {
-		ring_destroy(ports[portnum]->rxring); /* since the first one succeeded */
+		USART_RING(destroy)(ports[portnum]->rxring); /* since the first one succeeded */
 		free(ports[portnum]);
 		ports[portnum] = NULL;
 		return -ENOMEM; /* FIXME: flag usart IO no longer works */
 	}
 
+	_usart_connect(portnum);
+
+	return 0;
+}
+
+/* map the hardware for the port, and apply defaults */
+void _usart_connect(usart_portname_t portnum) {
 	/* connect the hardware */
 	switch (portnum) {
 #if defined(USARTC0)
@@ -389,12 +744,118 @@ int usart_init(usart_portname_t portnum, uint16_t rx_size, uint16_t tx_size) {
 	/* port has no features by default */
 	ports[portnum]->features = 0;
 
+#ifdef USART_FLOW
+	/* no flow control until usart_flow() is called */
+	ports[portnum]->rts = NULL;
+	ports[portnum]->cts = NULL;
+#endif // USART_FLOW
+
+	/* start counting from zero, the ring drop counts are left alone */
+	memset(&ports[portnum]->stats, 0, sizeof(usart_stats_t));
+
+	/* RX is not framed by default */
+	ports[portnum]->frame_mode = usart_frame_none;
+	ports[portnum]->frame_fn = NULL;
+	ports[portnum]->frame_len = 0;
+	ports[portnum]->frame_idle = 0;
+
+#ifdef USART_DMA_TX
+	/* TX is interrupt driven until usart_dma_tx() is called */
+	ports[portnum]->dma = NULL;
+	ports[portnum]->dma_busy = _DMA_IDLE;
+#endif // USART_DMA_TX
+
 	/* enable rx interrupts */
 	ports[portnum]->hw->CTRLA = (ports[portnum]->hw->CTRLA & ~(USART_RXCINTLVL_gm)) | (ports[portnum]->isr_level & USART_RXCINTLVL_gm);
 
 	/* make sure low-level interrupts are enabled. Note: you still need to enable global interrupts */
 	PMIC.CTRL |= PMIC_LOLVLEX_bm;
 
+	return;
+}
+
+/* search the baud rate generator settings for the closest to the rate */
+int usart_baud_solve(uint32_t fper, uint32_t baud, usart_baud_t *out) {
+	uint32_t div, actual, diff, best = UINT32_MAX;
+	uint32_t bsel;
+	uint8_t samples, s;
+	int8_t bscale;
+
+	if (!out || !baud || !fper || baud > (UINT32_MAX / 16)) {
+		return -EINVAL;
+	}
+
+	/* 16 samples per bit normally, 8 with CLK2X */
+	for (samples = 16; samples >= 8; samples -= 8) {
+		for (bscale = -7; bscale <= 7; bscale++) {
+			if (bscale < 0) {
+				/* fractional: baud = (fper << s) / (samples * (bsel + (1 << s))) */
+				s = -bscale;
+				div = samples * baud;
+				if (fper > (UINT32_MAX >> s) ||
+					(fper << s) > UINT32_MAX - div/2) {
+					continue;
+				}
+				bsel = ((fper << s) + div/2) / div;
+				if (bsel <= (1UL << s)) {
+					continue; /* BSEL would be zero or negative */
+				}
+				bsel -= (1UL << s);
+				if (bsel > 4095) {
+					continue;
+				}
+				div = samples * (bsel + (1UL << s));
+				actual = ((fper << s) + div/2) / div;
+			} else {
+				/* baud = fper / ((samples << bscale) * (bsel + 1)) */
+				if (baud > (UINT32_MAX >> (bscale + 4))) {
+					continue;
+				}
+				div = (samples * baud) << bscale;
+				bsel = (fper + div/2) / div;
+				if (!bsel) {
+					continue; /* faster than this prescale can go */
+				}
+				bsel--;
+				if (bsel > 4095) {
+					continue;
+				}
+				div = (samples << bscale) * (bsel + 1);
+				actual = (fper + div/2) / div;
+			}
+
+			diff = (actual > baud) ? (actual - baud) : (baud - actual);
+			if (diff < best) {
+				best = diff;
+				out->bsel = bsel;
+				out->bscale = bscale;
+				out->clk2x = (samples == 8);
+				out->actual = actual;
+			}
+		}
+	}
+
+	if (best == UINT32_MAX) {
+		/* out of range, report the fastest or slowest possible */
+		out->clk2x = (baud > fper / 16);
+		out->bsel = out->clk2x ? 0 : 4095;
+		out->bscale = out->clk2x ? 0 : 7;
+		out->actual = out->clk2x ? fper / 8 : fper / (16UL * 128 * 4096);
+		best = (out->actual > baud) ? (out->actual - baud) : (baud - out->actual);
+	}
+
+	/* 0.01% units, without overflowing 32 bits */
+	if (best >= baud / 2) {
+		out->error = (out->actual > baud) ? INT16_MAX : INT16_MIN;
+	} else {
+		div = (best < (UINT32_MAX / 10000)) ? (best * 10000) / baud :
+			best / (baud / 10000);
+		out->error = (out->actual > baud) ? (int16_t)div : -(int16_t)div;
+	}
+
+	if (out->error > USART_BAUD_ERR_MAX || out->error < -USART_BAUD_ERR_MAX) {
+		return -EBAUD;
+	}
 	return 0;
 }
 
@@ -403,8 +864,8 @@ int usart_conf(usart_portname_t portnum, uint32_t baud, uint8_t bits,
 	void (*rx_fn)(uint8_t)) {
 
 	uint8_t mode = 0;
-	uint8_t bscale = 0;
-	uint16_t bsel;
+	usart_baud_t rate;
+	int ret;
 
 	if (portnum > MAX_PORTS || !ports[portnum]) {
 		return -ENODEV;
@@ -457,70 +918,19 @@ int usart_conf(usart_portname_t portnum, uint32_t baud, uint8_t bits,
 	/* RX hook, safe provided RX is disabled */
 	ports[portnum]->rx_fn = rx_fn;
 
-    /* baud rates faster than this are impossible */
-	if (baud > (F_CPU/8)) {
-		return -EBAUD;
+	ret = usart_baud_solve(F_CPU, baud, &rate);
+	if (ret) {
+		return ret;
 	}
 
-    /* these are hardcoded values for known frequencies all require CLK2X */
-    /* FIXME: add more clock frequencies */
-    switch (baud) {
-#if (F_CPU == 32000000)
-        case 9600:
-            bsel = 3325;
-            bscale = -3;
-            break;
-        case 19200:
-            bsel = 3317;
-            bscale = -4;
-            break;
-        case 38400:
-            bsel = 3301;
-            bscale = -5;
-            break;
-        case 57600:
-            bsel = 2109;
-            bscale = -5;
-            break;
-        case 115200:
-            bsel = 2158;
-            bscale = -6;
-            break;
-        case 921600:
-            bsel = 428; /* limited by bscale */
-            bscale = -7;
-            break;
-#elif (F_CPU == 2000000)
-        case 9600:
-            bsel = 3205;
-            bscale = -7;
-            break;
-        case 19200:
-            bsel = 1539;
-            bscale = -7;
-            break;
-        case 38400:
-            bsel = 705;
-            bscale = -7;
-            break;
-        case 57600:
-            bsel = 428;
-            bscale = -7;
-            break;
-        case 115200:
-            bsel = 150;
-            bscale = -7;
-            break;
-#endif
-        default:
-            return -EBAUD;
-            break;
-    }
-
     /* apply the results of the calculation */
-	ports[portnum]->hw->BAUDCTRLA = bsel & 0xff;
-	ports[portnum]->hw->BAUDCTRLB = (bsel >> 8) | ((bscale & 0xf)<< 4);
-	ports[portnum]->hw->CTRLB |= USART_CLK2X_bm;
+	ports[portnum]->hw->BAUDCTRLA = rate.bsel & 0xff;
+	ports[portnum]->hw->BAUDCTRLB = (rate.bsel >> 8) | ((rate.bscale & 0xf)<< 4);
+	if (rate.clk2x) {
+		ports[portnum]->hw->CTRLB |= USART_CLK2X_bm;
+	} else {
+		ports[portnum]->hw->CTRLB &= ~(USART_CLK2X_bm);
+	}
 
 	/* all good! */
 	return 0;
@@ -531,7 +941,11 @@ int usart_stop(usart_portname_t portnum) {
 		/* do nothing */
 		return -ENODEV;
 	}
-	ports[portnum]->hw->CTRLB |= (USART_RXEN_bm | USART_TXEN_bm);
+	/* once stopped, we no longer need the peripheral clock in sleep */
+	if (ports[portnum]->hw->CTRLB & (USART_RXEN_bm | USART_TXEN_bm)) {
+		sleep_release(sleep_idle);
+	}
+	ports[portnum]->hw->CTRLB &= ~(USART_RXEN_bm | USART_TXEN_bm);
 	return 0;
 }
 
@@ -541,35 +955,411 @@ int usart_run(usart_portname_t portnum) {
 		return -ENODEV;
 	}
 
+	/* the USART is stopped by any sleep mode deeper than idle */
+	if (!(ports[portnum]->hw->CTRLB & (USART_RXEN_bm | USART_TXEN_bm))) {
+		sleep_hold(sleep_idle);
+	}
 	ports[portnum]->hw->CTRLB |= (USART_RXEN_bm | USART_TXEN_bm);
 	return 0;
 }
 
 int usart_flush(usart_portname_t portnum) {
+	uint8_t enabled;
 
 	if (portnum >= MAX_PORTS || !ports[portnum]) {
 		return -ENODEV;
 	}
 
-	/* disable the TX/RX engines */
+	/* disable the TX/RX engines, remembering if they were running, since
+	 * the sleep hold taken by usart_run() goes with that */
+	enabled = ports[portnum]->hw->CTRLB & (USART_RXEN_bm | USART_TXEN_bm);
 	ports[portnum]->hw->CTRLB &= ~(USART_RXEN_bm | USART_TXEN_bm);
 
 	/* protect this from interrupts */
 	ports[portnum]->hw->CTRLA = (ports[portnum]->hw->CTRLA & ~(USART_RXCINTLVL_gm | USART_DREINTLVL_gm));
 
-	ring_reset(ports[portnum]->txring);
-	ring_reset(ports[portnum]->rxring);
+#ifdef USART_DMA_TX
+	/* abandon whatever the DMA channel was sending */
+	if (ports[portnum]->dma) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			ports[portnum]->dma->CTRLA &= ~(DMA_CH_ENABLE_bm);
+			while (ports[portnum]->dma->CTRLA & DMA_CH_ENABLE_bm);
+			ports[portnum]->dma->CTRLB |= (DMA_CH_TRNIF_bm | DMA_CH_ERRIF_bm);
+			ports[portnum]->dma_busy = _DMA_IDLE;
+		}
+	}
+#endif // USART_DMA_TX
+
+	USART_RING(reset)(ports[portnum]->txring);
+	USART_RING(reset)(ports[portnum]->rxring);
+	ports[portnum]->frame_len = 0;
+#ifdef USART_FLOW
+	/* the RX ring is empty again */
+	if (ports[portnum]->rts) {
+		ports[portnum]->rts->OUTCLR = ports[portnum]->rts_bm;
+	}
+#endif // USART_FLOW
 
 	/* re-enable RX interrupts */
 	ports[portnum]->hw->CTRLA = (ports[portnum]->hw->CTRLA & ~(USART_RXCINTLVL_gm)) | (ports[portnum]->isr_level & USART_RXCINTLVL_gm);
 	/* for TX, since we just wiped the ring buffer, it has nothing to TX, so don't enable DRE */
 
-	/* re-enable the actual ports */
-	ports[portnum]->hw->CTRLB |= (USART_RXEN_bm | USART_TXEN_bm);
+	/* re-enable the actual ports, if they were running before */
+	ports[portnum]->hw->CTRLB |= enabled;
+
+	return 0;
+}
+
+int usart_frame(usart_portname_t portnum, usart_frame_t mode, uint16_t arg,
+	void (*frame_fn)(usart_ring_t *, uint16_t)) {
+	usart_port_t *port;
+
+	if (portnum >= MAX_PORTS || !ports[portnum]) {
+		return -ENODEV;
+	}
+	if (mode > usart_frame_idle || (mode != usart_frame_none &&
+		(!frame_fn || (mode == usart_frame_delim ? arg > 0xff : !arg)))) {
+		return -EINVAL;
+	}
+	port = ports[portnum];
+
+	/* the RX ISR must see a consistent set */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		port->frame_mode = mode;
+		port->frame_arg = arg;
+		port->frame_fn = frame_fn;
+		/* anything already in the ring is not part of a frame */
+		port->frame_len = 0;
+		port->frame_idle = 0;
+	}
+	return 0;
+}
+
+void usart_frame_tick(usart_portname_t portnum) {
+	usart_port_t *port;
+	uint16_t len = 0;
+
+	if (portnum >= MAX_PORTS || !ports[portnum]) {
+		return;
+	}
+	port = ports[portnum];
+	if (port->frame_mode != usart_frame_idle) {
+		return;
+	}
+
+	/* the timer may run at a different level to RX, but the callback
+	 * runs with interrupts back on */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (port->frame_len && ++port->frame_idle >= port->frame_arg) {
+			len = _usart_frame_take(port);
+		}
+	}
+	_usart_frame_end(port, len);
+}
+
+#ifdef USART_FLOW
+int usart_flow(usart_portname_t portnum, PORT_t *rts, uint8_t rts_pin,
+	PORT_t *cts, uint8_t cts_pin, uint16_t high, uint16_t low) {
+	usart_port_t *port;
+	void (*stop)(usart_ring_t *);
+	void (*go)(usart_ring_t *);
+
+	if (portnum >= MAX_PORTS || !ports[portnum]) {
+		return -ENODEV;
+	}
+	port = ports[portnum];
+	if (rts_pin > 7 || cts_pin > 7 ||
+		(rts && (low >= high || high > port->rxring->mask))) {
+		return -EINVAL;
+	}
+
+	/* the watermark hooks for this port number */
+	switch (portnum) {
+		_USART_RTS_CASE(0)
+		_USART_RTS_CASE(1)
+		_USART_RTS_CASE(2)
+		_USART_RTS_CASE(3)
+		_USART_RTS_CASE(4)
+#if MAX_PORTS > 5
+		_USART_RTS_CASE(5)
+#endif
+#if MAX_PORTS > 6
+		_USART_RTS_CASE(6)
+#endif
+#if MAX_PORTS > 7
+		_USART_RTS_CASE(7)
+#endif
+		default:
+			return -ENODEV;
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (port->cts) {
+			port->cts->INT0MASK &= ~(port->cts_bm);
+		}
+		port->rts = rts;
+		port->rts_bm = (1 << rts_pin);
+		port->cts = cts;
+		port->cts_bm = (1 << cts_pin);
+
+		if (rts) {
+			/* RTS is active low, start off ready to receive */
+			rts->OUTCLR = port->rts_bm;
+			rts->DIRSET = port->rts_bm;
+			USART_RING(watermark)(port->rxring, high, stop, low, go);
+		} else {
+			USART_RING(watermark)(port->rxring, 0, NULL, 0, NULL);
+		}
+
+		if (cts) {
+			/* CTS is active low, interrupt on either edge at the TX level */
+			cts->DIRCLR = port->cts_bm;
+			(&cts->PIN0CTRL)[cts_pin] = ((&cts->PIN0CTRL)[cts_pin] & ~(PORT_ISC_gm)) |
+				PORT_ISC_BOTHEDGES_gc;
+			cts->INT0MASK |= port->cts_bm;
+			cts->INTCTRL = (cts->INTCTRL & ~(PORT_INT0LVL_gm)) |
+				(port->isr_level & USART_DREINTLVL_gm);
+		}
+	}
+
+	/* pick up anything held back while CTS was not watched */
+	if (USART_RING(readable)(port->txring)) {
+		_usart_tx_run(port);
+	}
+	return 0;
+}
+#endif // USART_FLOW
+
+int usart_stats(usart_portname_t portnum, usart_stats_t *out) {
+	usart_port_t *port;
+
+	if (portnum >= MAX_PORTS || !ports[portnum]) {
+		return -ENODEV;
+	}
+	if (!out) {
+		return -EINVAL;
+	}
+	port = ports[portnum];
+
+	/* the ISRs update these, so take a consistent copy */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		*out = port->stats;
+		out->rx_dropped = USART_RING(dropped)(port->rxring);
+		out->tx_dropped = USART_RING(dropped)(port->txring);
+	}
+	return 0;
+}
+
+int usart_stats_reset(usart_portname_t portnum) {
+	usart_port_t *port;
+
+	if (portnum >= MAX_PORTS || !ports[portnum]) {
+		return -ENODEV;
+	}
+	port = ports[portnum];
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memset(&port->stats, 0, sizeof(usart_stats_t));
+		USART_RING(dropped_reset)(port->rxring);
+		USART_RING(dropped_reset)(port->txring);
+	}
+	return 0;
+}
+
+int usart_write(usart_portname_t portnum, const char *buf, uint16_t len) {
+	usart_port_t *port;
+	uint16_t space, chunk, done;
+
+	if (portnum >= MAX_PORTS || !ports[portnum]) {
+		return -ENODEV;
+	}
+	if (!buf) {
+		return -EINVAL;
+	}
+	port = ports[portnum];
+
+	/* only take what fits, the caller sends the rest later */
+	if (port->features & U_FEAT_ECHO) {
+		/* the RX ISR is a second producer, see usart_put(), so copy a
+		 * little at a time, letting interrupts in between */
+		for (done = 0; done < len; done += chunk) {
+			chunk = len - done;
+			if (chunk > USART_ECHO_CHUNK) {
+				chunk = USART_ECHO_CHUNK;
+			}
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				space = USART_RING(free)(port->txring);
+				if (chunk > space) {
+					chunk = space;
+				}
+				chunk = USART_RING(write_block_unsafe)(port->txring,
+					buf + done, chunk);
+			}
+			if (!chunk) {
+				break;
+			}
+		}
+		len = done;
+	} else {
+		len = USART_RING(write_block)(port->txring, buf, len);
+	}
+
+	if (len) {
+		_usart_tx_run(port);
+	}
+	return len;
+}
+
+int usart_read(usart_portname_t portnum, char *buf, uint16_t len) {
+	if (portnum >= MAX_PORTS || !ports[portnum]) {
+		return -ENODEV;
+	}
+	if (!buf) {
+		return -EINVAL;
+	}
+	return USART_RING(read_block)(ports[portnum]->rxring, buf, len);
+}
+
+#ifdef USART_DMA_TX
+int usart_dma_tx(usart_portname_t portnum, uint8_t channel) {
+	usart_port_t *port;
+	DMA_CH_t *ch;
+	uint8_t trigsrc, level;
+
+	if (portnum >= MAX_PORTS || !ports[portnum]) {
+		return -ENODEV;
+	}
+	if (channel >= USART_DMA_CHANNELS) {
+		return -EINVAL;
+	}
+	if (dma_ports[channel]) {
+		return -EBUSY;
+	}
+	port = ports[portnum];
+	if (port->dma) {
+		return -EBUSY;
+	}
+
+	/* each USART has its own data register empty trigger */
+	switch (portnum) {
+#if defined(USARTC0)
+		case usart_c0:
+			trigsrc = DMA_CH_TRIGSRC_USARTC0_DRE_gc;
+			break;
+#endif
+#if defined(USARTC1)
+		case usart_c1:
+			trigsrc = DMA_CH_TRIGSRC_USARTC1_DRE_gc;
+			break;
+#endif
+#if defined(USARTD0)
+		case usart_d0:
+			trigsrc = DMA_CH_TRIGSRC_USARTD0_DRE_gc;
+			break;
+#endif
+#if defined(USARTD1)
+		case usart_d1:
+			trigsrc = DMA_CH_TRIGSRC_USARTD1_DRE_gc;
+			break;
+#endif
+#if defined(USARTE0)
+		case usart_e0:
+			trigsrc = DMA_CH_TRIGSRC_USARTE0_DRE_gc;
+			break;
+#endif
+#if defined(USARTE1)
+		case usart_e1:
+			trigsrc = DMA_CH_TRIGSRC_USARTE1_DRE_gc;
+			break;
+#endif
+#if defined(USARTF0)
+		case usart_f0:
+			trigsrc = DMA_CH_TRIGSRC_USARTF0_DRE_gc;
+			break;
+#endif
+#if defined(USARTF1)
+		case usart_f1:
+			trigsrc = DMA_CH_TRIGSRC_USARTF1_DRE_gc;
+			break;
+#endif
+		default:
+			return -ENODEV;
+	}
+
+	ch = &DMA.CH0 + channel;
+
+	PR.PRGEN &= ~(PR_DMA_bm);
+	DMA.CTRL |= DMA_ENABLE_bm;
+
+	/* one byte each time DATA is empty, from incrementing memory to DATA */
+	ch->CTRLA = DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
+	ch->ADDRCTRL = DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_INC_gc |
+		DMA_CH_DESTRELOAD_NONE_gc | DMA_CH_DESTDIR_FIXED_gc;
+	ch->TRIGSRC = trigsrc;
+	ch->DESTADDR0 = (uint16_t)&port->hw->DATA & 0xff;
+	ch->DESTADDR1 = (uint16_t)&port->hw->DATA >> 8;
+	ch->DESTADDR2 = 0;
+	/* complete or fail at the level DRE would have used, all three encode
+	 * levels alike */
+	level = port->isr_level & USART_DREINTLVL_gm;
+	ch->CTRLB = (DMA_CH_TRNIF_bm | DMA_CH_ERRIF_bm) |
+		(level << DMA_CH_ERRINTLVL_gp) | (level << DMA_CH_TRNINTLVL_gp);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		/* hand the ring over from the DRE interrupt to the DMA channel */
+		port->hw->CTRLA = port->hw->CTRLA & ~(USART_DREINTLVL_gm);
+		dma_ports[channel] = port;
+		port->dma_busy = _DMA_IDLE;
+		port->dma = ch;
+		_usart_dma_next(port);
+	}
 
 	return 0;
 }
 
+int usart_write_dma(usart_portname_t portnum, const char *buf, uint16_t len) {
+	usart_port_t *port;
+	int ret = 0;
+
+	if (portnum >= MAX_PORTS || !ports[portnum]) {
+		return -ENODEV;
+	}
+	port = ports[portnum];
+	if (!port->dma || !buf) {
+		return -EINVAL;
+	}
+	if (!len) {
+		return 0;
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		/* anything already in the ring has to go out first */
+		if (port->dma_busy || USART_RING(readable)(port->txring)) {
+			ret = -EBUSY;
+		} else {
+			/* held until it is started, which may wait for CTS */
+			port->dma_buf = buf;
+			port->dma_len = len;
+			port->dma_busy = _DMA_HELD;
+			_usart_dma_next(port);
+		}
+	}
+
+	return ret;
+}
+
+int usart_dma_busy(usart_portname_t portnum) {
+	if (portnum >= MAX_PORTS || !ports[portnum]) {
+		return -ENODEV;
+	}
+	if (!ports[portnum]->dma) {
+		return -EINVAL;
+	}
+	return (ports[portnum]->dma_busy == _DMA_BUF ||
+		ports[portnum]->dma_busy == _DMA_HELD);
+}
+#endif // USART_DMA_TX
+
 int usart_put(char s, FILE *handle) {
 	usart_port_t *port;
 	/* reteieve the pointer to the struct for our hardware */
@@ -577,7 +1367,15 @@ int usart_put(char s, FILE *handle) {
 	if (!port) {
 		return _FDEV_ERR; /* avr-libc doesn't describe this, but never mind */
 	}
-	ring_write(port->txring,s);
+	if (port->features & U_FEAT_ECHO) {
+		/* the RX ISR also writes to the TX ring, so we can't rely on the
+		 * ring being single producer here */
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			USART_RING(write_unsafe)(port->txring,s);
+		}
+	} else {
+		USART_RING(write)(port->txring,s);
+	}
 	_usart_tx_run(port);
 	return 0;
 }
@@ -589,8 +1387,8 @@ int usart_get(FILE *handle) {
 	if (!port) {
 		return _FDEV_ERR;
 	}
-	if (ring_readable(port->rxring)) {
-		return ring_read(port->rxring);
+	if (USART_RING(readable)(port->rxring)) {
+		return USART_RING(read)(port->rxring);
 	}
 	return _FDEV_EOF;
 }
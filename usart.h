@@ -28,6 +28,10 @@ extern "C" {
 #endif
 
 #include "global.h"
+#include "ringbuffer.h"
+#ifdef USART_RING_WIDE
+#include "ring16.h"
+#endif
 
 /** \file
  *  \brief USART driver public API
@@ -51,6 +55,24 @@ extern "C" {
  *  implemented, as all code is generic
  */
 
+#ifdef USART_RING_WIDE
+/** \brief Ringbuffer type used for the port buffers */
+typedef ring16_t usart_ring_t;
+/** \brief Largest port buffer */
+#define USART_RING_MAX RING16_MAX
+/** \brief Name of the ringbuffer function fn for the port buffers, eg
+ *  USART_RING(peek_read) */
+#define USART_RING(fn) ring16_##fn
+#else
+/** \brief Ringbuffer type used for the port buffers */
+typedef ringbuffer_t usart_ring_t;
+/** \brief Largest port buffer */
+#define USART_RING_MAX RINGBUFFER_MAX
+/** \brief Name of the ringbuffer function fn for the port buffers, eg
+ *  USART_RING(peek_read) */
+#define USART_RING(fn) ring_##fn
+#endif // USART_RING_WIDE
+
 #define U_FEAT_NONE 0 /**< USART port feature: None */
 #define U_FEAT_ECHO 1 /**< USART port feature: echoback inside driver */
 
@@ -169,6 +191,39 @@ typedef enum {
 
 #endif // _xmega_type
 
+/** \brief How the end of an RX frame is found, see usart_frame() */
+typedef enum {
+	usart_frame_none = 0, /**< RX is not framed */
+	usart_frame_delim, /**< Frame ends with a delimiter character */
+	usart_frame_len, /**< Frame is a fixed number of characters */
+	usart_frame_idle, /**< Frame ends when the line goes idle */
+} usart_frame_t;
+
+/** \brief Per-port counters, see usart_stats() */
+typedef struct {
+	uint32_t rx; /**< Characters received, including those dropped */
+	uint32_t tx; /**< Characters handed to the hardware to send */
+	uint16_t frame_err; /**< Characters received with a framing error */
+	uint16_t overrun; /**< Hardware RX buffer overruns, chars were lost */
+	uint16_t parity_err; /**< Characters received with a parity error */
+	uint16_t rx_dropped; /**< Characters lost to a full RX ring */
+	uint16_t tx_dropped; /**< Characters lost to a full TX ring */
+} usart_stats_t;
+
+/** \brief Largest baud rate error usart_conf() accepts, in 0.01% */
+#ifndef USART_BAUD_ERR_MAX
+#define USART_BAUD_ERR_MAX 200
+#endif
+
+/** \brief Baud rate generator settings found by usart_baud_solve() */
+typedef struct {
+	uint16_t bsel; /**< BSEL, 12 bits */
+	int8_t bscale; /**< BSCALE, -7 to 7 */
+	uint8_t clk2x; /**< 1 if CLK2X is needed, 0 otherwise */
+	uint32_t actual; /**< Baud rate these settings give */
+	int16_t error; /**< Error of actual from the requested rate, in 0.01% */
+} usart_baud_t;
+
 /** \brief Enum for parity types */
 typedef enum {
 	none, /**< No parity */
@@ -181,7 +236,9 @@ typedef enum {
  *
  *  Buffer sizes for rx_size and tx_size are the total number of
  *  bytes to buffer. Must be a power of two, and not larger than
- *  RINGBUFFER_MAX. (see ringbuffer.h)
+ *  USART_RING_MAX, which is 256 bytes unless the library is built with
+ *  USART_RING_WIDE. That gives the ports ring16.h ringbuffers instead of
+ *  ringbuffer.h ones, raising the limit to 32kB.
  *
  *  \param portnum Number of the port
  *  \param rx_size Size of the RX buffer
@@ -190,6 +247,23 @@ typedef enum {
  */
 int usart_init(usart_portname_t portnum, uint16_t rx_size, uint16_t tx_size);
 
+/** \brief Initalise the given serial port with caller provided buffers
+ *
+ *  Same as usart_init(), but the RX and TX ringbuffers are supplied by
+ *  the caller, eg with RING_DEFINE() and RING_INIT() (RING16_DEFINE() and
+ *  RING16_INIT() with USART_RING_WIDE), so that the ring
+ *  storage does not come from the heap. The port metadata is statically
+ *  allocated too, so this path never calls malloc(). That storage is only
+ *  linked in, and only takes up RAM, if this function is used.
+ *
+ *  \param portnum Number of the port
+ *  \param rxring Initialised ringbuffer to use for RX
+ *  \param txring Initialised ringbuffer to use for TX
+ *  \return 0 for success, negative errors.h values otherwise
+ */
+int usart_init_static(usart_portname_t portnum, usart_ring_t *rxring,
+	usart_ring_t *txring);
+
 /** \brief Set parameters for the port, speed and such like
  *
  *  This must be called when the port is suspended or very bad things
@@ -197,7 +271,7 @@ int usart_init(usart_portname_t portnum, uint16_t rx_size, uint16_t tx_size);
  *  with a stream.
  *
  *  \param portnum Number of the port
- *  \param baud Baudrate
+ *  \param baud Baudrate, any rate usart_baud_solve() can reach at F_CPU
  *  \param bits Bits per char (note: 9 is not supported)
  *  \param parity Parity mode (none, even, odd)
  *  \param stop Stop bits
@@ -209,8 +283,29 @@ int usart_init(usart_portname_t portnum, uint16_t rx_size, uint16_t tx_size);
 int usart_conf(usart_portname_t portnum, uint32_t baud, uint8_t bits,
 	parity_t parity, uint8_t stop, uint8_t features, void (*rxfn)(uint8_t));
 
+/** \brief Find the closest baud rate generator settings to a rate
+ *
+ *  Searches every BSCALE and BSEL, with and without CLK2X, for the lowest
+ *  error at the given peripheral clock. Without CLK2X is preferred when
+ *  both are as close, since the receiver then takes more samples per bit.
+ *
+ *  This is what usart_conf() uses with F_CPU. It can also be used to check
+ *  a rate before committing to it, eg for a clock other than F_CPU.
+ *
+ *  \param fper Peripheral clock in Hz
+ *  \param baud Baud rate wanted
+ *  \param out Filled in with the best settings found
+ *  \return 0 if the error is within USART_BAUD_ERR_MAX, -EBAUD if not
+ *  (out is still filled in), -EINVAL for bad arguments
+ */
+int usart_baud_solve(uint32_t fper, uint32_t baud, usart_baud_t *out);
+
 /** \brief Start listening for events and characters, also allows
  *  TX to begin
+ *
+ *  While running, the port prevents sleep_enter() from going deeper
+ *  than sleep_idle.
+ *
  *  \param portnum Number of the port
  */
 int usart_run(usart_portname_t portnum);
@@ -222,6 +317,9 @@ int usart_run(usart_portname_t portnum);
 int usart_stop(usart_portname_t portnum);
 
 /** \brief Flush the buffers for the serial port
+ *
+ *  The port is left running or stopped as it was found.
+ *
  *  \param portnum Number of the port
  *  \return 0 for success, negative errors.h values otherwise
  */
@@ -239,6 +337,186 @@ int usart_flush(usart_portname_t portnum);
  */
 FILE *usart_map_stdio(usart_portname_t portnum);
 
+/** \brief Have the port deliver RX in frames rather than characters
+ *
+ *  Instead of the per-character RX hook, frame_fn is called once per
+ *  complete frame from the RX interrupt, with the RX ring and the length
+ *  of the frame. The frame is left in the ring as the next len characters
+ *  to be read, so it can be handled in place with USART_RING(peek_read)
+ *  and USART_RING(commit_read) (twice if the frame wraps), or read with
+ *  usart_read(). Frames queue up in the ring if the consumer is slow, so
+ *  each one must be consumed in full, in order. frame_fn may eg run a
+ *  sched_task_t to do the work outside of the interrupt.
+ *
+ *  Modes are:
+ *
+ *  + usart_frame_delim, arg is the character ending each frame, which is
+ *    included in it
+ *
+ *  + usart_frame_len, arg is the length of each frame
+ *
+ *  + usart_frame_idle, arg is the number of usart_frame_tick() calls with
+ *    no characters received which ends a frame. Ticks are not in step
+ *    with RX, so eg ticking once per character time with an arg of 4
+ *    ends a frame after 3 to 4 idle character times, as Modbus RTU wants
+ *
+ *  Characters dropped because the RX ring was full are left out of the
+ *  frame. The RX ring must not be in RING_F_OVERWRITE mode.
+ *
+ *  \param portnum Number of the port
+ *  \param mode How frames end, usart_frame_none to turn framing off
+ *  \param arg Delimiter, length or idle ticks as above
+ *  \param frame_fn Function to call for each frame, from the RX interrupt,
+ *  or from usart_frame_tick() in idle mode, never with interrupts held off
+ *  \return 0 for success, negative errors.h values otherwise
+ */
+int usart_frame(usart_portname_t portnum, usart_frame_t mode, uint16_t arg,
+	void (*frame_fn)(usart_ring_t *, uint16_t));
+
+/** \brief Time the idle gap ending frames in usart_frame_idle mode
+ *
+ *  Call regularly, eg from a timer overflow hook. Safe from any
+ *  interrupt level.
+ *
+ *  \param portnum Number of the port
+ */
+void usart_frame_tick(usart_portname_t portnum);
+
+#ifdef USART_FLOW
+/** \brief Set up RTS/CTS hardware flow control on the port
+ *
+ *  RTS is an output, driven high when the RX ring reaches high characters
+ *  and low again once it is drained to low. CTS is an input; while it is
+ *  high, TX stops after the character in progress and resumes from a pin
+ *  change interrupt once it goes low. With usart_dma_tx(), the DMA
+ *  channel is stopped from the same interrupt, after the character in
+ *  flight, and picks up where it left off. Both are active low, as on the
+ *  usual RS232 level shifters. Call after usart_conf() and before
+ *  usart_run().
+ *
+ *  Only available when built with USART_FLOW. CTS uses the INT0 interrupt
+ *  of its IO port, so the INT0 mask of a port holding a CTS pin belongs to
+ *  this driver. The driver does not define the vector, the application
+ *  calls usart_cts_isr() from its own, see there.
+ *
+ *  The RX ring watermark hooks are used for RTS, so must not be used for
+ *  anything else on this port. Leave room above high for the characters
+ *  the far end sends after RTS goes high, eg the size of its TX FIFO.
+ *
+ *  \param portnum Number of the port
+ *  \param rts IO port of the RTS pin, eg &PORTC, NULL for no RTS
+ *  \param rts_pin Pin number of RTS, 0-7
+ *  \param cts IO port of the CTS pin, NULL for no CTS
+ *  \param cts_pin Pin number of CTS, 0-7
+ *  \param high RX ring fill at which RTS is deasserted
+ *  \param low RX ring fill at which RTS is asserted again
+ *  \return 0 for success, negative errors.h values otherwise
+ */
+int usart_flow(usart_portname_t portnum, PORT_t *rts, uint8_t rts_pin,
+	PORT_t *cts, uint8_t cts_pin, uint16_t high, uint16_t low);
+
+/** \brief Handle a CTS pin change
+ *
+ *  Call from the INT0 vector of each IO port holding a CTS pin, eg
+ *
+ *      ISR(PORTC_INT0_vect) {
+ *          usart_cts_isr(&PORTC);
+ *      }
+ *
+ *  This leaves the vector, and INT1, free for the application on ports
+ *  without CTS. Several USARTs may share an IO port for CTS.
+ *
+ *  \param io IO port the change happened on
+ */
+void usart_cts_isr(PORT_t *io);
+#endif // USART_FLOW
+
+/** \brief Read the counters for the port
+ *
+ *  Telling the error classes apart separates a noisy line (framing and
+ *  parity errors), a CPU too busy to service RX (overruns) and an RX ring
+ *  too small for the consumer (RX drops). Counters wrap.
+ *
+ *  The drop counts are those of the rings, see ring_dropped().
+ *
+ *  \param portnum Number of the port
+ *  \param out Filled in with the counters
+ *  \return 0 for success, negative errors.h values otherwise
+ */
+int usart_stats(usart_portname_t portnum, usart_stats_t *out);
+
+/** \brief Clear the counters for the port, including the ring drop counts
+ *  \param portnum Number of the port
+ *  \return 0 for success, negative errors.h values otherwise
+ */
+int usart_stats_reset(usart_portname_t portnum);
+
+/** \brief Write a block of characters to the port
+ *
+ *  Copies as much of buf as fits into the TX ring and starts TX once,
+ *  rather than once per character as stdio does. Does not block.
+ *
+ *  \param portnum Number of the port
+ *  \param buf Characters to send
+ *  \param len Number of characters to send
+ *  \return Number of characters taken, which may be less than len if the
+ *  TX ring filled up, negative errors.h values otherwise
+ */
+int usart_write(usart_portname_t portnum, const char *buf, uint16_t len);
+
+/** \brief Read a block of characters from the port
+ *
+ *  Copies whatever is waiting in the RX ring, up to len. Does not block.
+ *
+ *  \param portnum Number of the port
+ *  \param buf Buffer to read into
+ *  \param len Size of buf
+ *  \return Number of characters read, 0 if none were waiting, negative
+ *  errors.h values otherwise
+ */
+int usart_read(usart_portname_t portnum, char *buf, uint16_t len);
+
+#ifdef USART_DMA_TX
+/** \brief Transmit from the port with a DMA channel
+ *
+ *  Rather than one interrupt per character, the channel is started on
+ *  each contiguous block of the TX ring and interrupts once the block has
+ *  gone out. usart_put() and stdio work as before. The port keeps the
+ *  channel from then on.
+ *
+ *  Only available when built with USART_DMA_TX, which also claims the
+ *  DMA channel interrupts for this driver.
+ *
+ *  \param portnum Number of the port
+ *  \param channel DMA channel to use, 0 to 3
+ *  \return 0 for success, -EBUSY if the channel or port already has one,
+ *  negative errors.h values otherwise
+ */
+int usart_dma_tx(usart_portname_t portnum, uint8_t channel);
+
+/** \brief Send a caller buffer on a port set up with usart_dma_tx()
+ *
+ *  The buffer is sent by DMA as a single block without copying it into
+ *  the TX ring, so it must not be changed until usart_dma_busy() returns
+ *  0. Anything written with usart_put() meanwhile is sent afterwards. If
+ *  the DMA controller reports an error, the rest of the buffer is dropped
+ *  and the port carries on with the TX ring.
+ *
+ *  \param portnum Number of the port
+ *  \param buf Buffer to send, in internal SRAM
+ *  \param len Number of bytes to send
+ *  \return 0 for success, -EBUSY if the TX ring or a previous buffer has
+ *  not yet been sent, negative errors.h values otherwise
+ */
+int usart_write_dma(usart_portname_t portnum, const char *buf, uint16_t len);
+
+/** \brief Check if a buffer from usart_write_dma() is still being sent
+ *  \param portnum Number of the port
+ *  \return 1 if busy, 0 if done, negative errors.h values otherwise
+ */
+int usart_dma_busy(usart_portname_t portnum);
+#endif // USART_DMA_TX
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,72 @@
+/* Copyright (C) 2009-2014 David Zanetti
+ *
+ * This file is part of libkakapo.
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* USART driver internals, shared by usart.c and usart_static.c */
+
+/* Not a public header. usart_init_static() lives in its own object, so
+ * the static port storage it needs is only linked in when it is used. */
+
+#ifndef USART_IMPL_H_INCLUDED
+#define USART_IMPL_H_INCLUDED
+
+#include <avr/io.h>
+#include "usart.h"
+
+/* hw access, buffers, and metadata about a usart port */
+
+/** \struct usart_port_t
+ *  \brief  Contains the abstraction of a hardware port
+ */
+typedef struct {
+	USART_t *hw; /**< USART hardware IO registers */
+	usart_ring_t *txring; /**< TX ringbuffer */
+	usart_ring_t *rxring; /**< RX ringbuffer */
+	uint8_t isr_level; /**< Level to run/restore interrupts at */
+	uint8_t features; /**< Capabilities of the port, see U_FEAT_ */
+	void (*rx_fn)(uint8_t); /**< Callback function for RX */
+	usart_frame_t frame_mode; /**< How RX frames end, see usart_frame() */
+	uint16_t frame_arg; /**< Delimiter, length or idle ticks ending a frame */
+	uint16_t frame_len; /**< Characters in the RX ring for the current frame */
+	uint16_t frame_idle; /**< Ticks since the last character was received */
+	void (*frame_fn)(usart_ring_t *, uint16_t); /**< Callback per RX frame */
+	usart_stats_t stats; /**< Counters, the dropped counts live in the rings */
+#ifdef USART_FLOW
+	PORT_t *rts; /**< Port of the RTS output, NULL if none */
+	uint8_t rts_bm; /**< Pin of the RTS output */
+	PORT_t *cts; /**< Port of the CTS input, NULL if none */
+	uint8_t cts_bm; /**< Pin of the CTS input */
+#endif // USART_FLOW
+#ifdef USART_DMA_TX
+	DMA_CH_t *dma; /**< DMA channel for TX, NULL for interrupt driven TX */
+	volatile uint8_t dma_busy; /**< What the DMA channel is sending, see _DMA_ */
+	uint16_t dma_len; /**< Length of the block being sent */
+	const char *dma_buf; /**< Rest of the caller buffer, see _DMA_HELD */
+#endif // USART_DMA_TX
+} usart_port_t;
+
+/** \brief USART port abstractions, NULL for ports not initalised */
+extern usart_port_t *ports[MAX_PORTS];
+
+/** \brief Connect the hardware for a port and apply default settings
+ *  \param portnum Number of the port, which must have its rings set up
+ */
+void _usart_connect(usart_portname_t portnum);
+
+#endif // USART_IMPL_H_INCLUDED
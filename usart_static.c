@@ -0,0 +1,62 @@
+/* Copyright (C) 2009-2014 David Zanetti
+ *
+ * This file is part of libkakapo.
+ *
+ * libkakapo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License.
+ *
+ * libkakapo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with libkapapo.
+ *
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* USART ports with static storage */
+
+#include <avr/io.h>
+
+#include "usart.h"
+#include "usart_impl.h"
+#include "errors.h"
+
+/** \file
+ *  \brief usart_init_static(), kept apart from the rest of the driver
+ *
+ *  The port abstractions here only take up RAM in applications which call
+ *  usart_init_static(), since the linker leaves this object out of the
+ *  others.
+ */
+
+/** \brief Port abstractions for usart_init_static(), which uses no heap */
+usart_port_t static_ports[MAX_PORTS];
+
+/* initalise the structures and hardware, with rings provided by the caller */
+int usart_init_static(usart_portname_t portnum, usart_ring_t *rxring,
+	usart_ring_t *txring) {
+
+	if (portnum >= MAX_PORTS || ports[portnum]) {
+		/* refuse to re-initalise a port or one not allocatable */
+		return -ENODEV;
+	}
+
+	if (!rxring || !txring || rxring == txring) {
+		return -EINVAL;
+	}
+
+	/* the metadata for the port is static too */
+	ports[portnum] = &static_ports[portnum];
+
+	ports[portnum]->rxring = rxring;
+	ports[portnum]->txring = txring;
+
+	_usart_connect(portnum);
+
+	return 0;
+}
@@ -24,6 +24,22 @@
 #include "global.h"
 #include "errors.h"
 #include "wdt.h"
+#include <util/atomic.h>
+
+/* identifies a valid culprit record in .noinit */
+#define _WDT_MAGIC 0x57d7
+
+/* clients of the supervisor */
+wdt_client_t *_wdt_clients = NULL;
+/* set once a client has missed a check-in */
+uint8_t _wdt_failed = 0;
+
+/* which client missed its check-in, this survives the reset */
+struct {
+    uint16_t magic;
+    uint8_t id;
+    uint8_t check; /**< ~id, to catch a record damaged by power loss */
+} _wdt_record __attribute__ ((section (".noinit")));
 
 /* normal mode configuration */
 int wdt_normal(wdt_clk_t timeout) {
@@ -75,3 +91,90 @@ int wdt_window(wdt_clk_t closed, wdt_clk_t open) {
     /* all done */
     return 0;
 }
+
+int wdt_client_add(wdt_client_t *client, uint8_t id, uint16_t period) {
+    wdt_client_t *c;
+    int ret = 0;
+
+    if (!client || !period) {
+        return -EINVAL;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        /* adding it twice would link it to itself */
+        for (c = _wdt_clients; c; c = c->next) {
+            if (c == client) {
+                ret = -EEXIST;
+                break;
+            }
+        }
+        if (!ret) {
+            client->id = id;
+            client->period = period;
+            client->left = period;
+            client->checked = 0;
+            client->next = _wdt_clients;
+            _wdt_clients = client;
+        }
+    }
+
+    return ret;
+}
+
+int wdt_client_remove(wdt_client_t *client) {
+    wdt_client_t **c;
+    int ret = -EINVAL;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        for (c = &_wdt_clients; *c; c = &(*c)->next) {
+            if (*c == client) {
+                *c = client->next;
+                ret = 0;
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
+void wdt_supervise(void) {
+    wdt_client_t *c;
+
+    /* we've already given up, let the watchdog expire */
+    if (_wdt_failed) {
+        return;
+    }
+
+    for (c = _wdt_clients; c; c = c->next) {
+        if (c->checked) {
+            c->checked = 0;
+            c->left = c->period;
+        } else if (!--c->left) {
+            /* record who it was, and stop resetting the watchdog */
+            _wdt_record.id = c->id;
+            _wdt_record.check = ~c->id;
+            _wdt_record.magic = _WDT_MAGIC;
+            _wdt_failed = 1;
+            return;
+        }
+    }
+
+    wdt_reset();
+}
+
+int wdt_culprit(void) {
+    int ret = -EINVAL;
+
+    /* the record is only current if the watchdog caused this reset,
+     * anything else may have come along since it was written */
+    if ((RST.STATUS & RST_WDRF_bm) && _wdt_record.magic == _WDT_MAGIC &&
+        _wdt_record.check == (uint8_t)~_wdt_record.id) {
+        ret = _wdt_record.id;
+    }
+    /* only report it once, the flag is cleared by writing one to it */
+    RST.STATUS = RST_WDRF_bm;
+    _wdt_record.magic = 0;
+
+    return ret;
+}
@@ -70,6 +70,70 @@ int wdt_normal(wdt_clk_t timeout);
  */
 int wdt_window(wdt_clk_t closed, wdt_clk_t open);
 
+/** \brief A client of the watchdog supervisor
+ *
+ *  Treat the contents as private, set them up with wdt_client_add().
+ */
+typedef struct wdt_client_s {
+    struct wdt_client_s *next; /**< Next client of the supervisor */
+    uint16_t period; /**< Supervisor ticks allowed between check-ins */
+    uint16_t left; /**< Supervisor ticks left before this client is late */
+    volatile uint8_t checked; /**< Set by wdt_checkin() */
+    uint8_t id; /**< Identity recorded if this client misses a check-in */
+} wdt_client_t;
+
+/** \brief Add a client to the watchdog supervisor
+ *
+ *  The supervisor shares one hardware watchdog between any number of
+ *  tasks or drivers. Each client must call wdt_checkin() at least every
+ *  period calls of wdt_supervise(). wdt_supervise() only resets the
+ *  hardware watchdog while every client has done so. When one doesn't,
+ *  its id is kept over the reset, and can be retrieved by wdt_culprit().
+ *
+ *  \param client Client to add, must stay valid until removed
+ *  \param id Identity of the client, reported by wdt_culprit()
+ *  \param period Number of wdt_supervise() calls allowed between
+ *  check-ins
+ *  \return 0 on success, -EEXIST if already a client, errors.h otherwise
+ */
+int wdt_client_add(wdt_client_t *client, uint8_t id, uint16_t period);
+
+/** \brief Remove a client from the watchdog supervisor
+ *
+ *  \param client Client given to wdt_client_add()
+ *  \return 0 on success, -EINVAL if not a client
+ */
+int wdt_client_remove(wdt_client_t *client);
+
+/** \brief Tell the watchdog supervisor a client is still alive
+ *
+ *  This is safe to call from interrupts.
+ *
+ *  \param client Client given to wdt_client_add()
+ */
+static inline void wdt_checkin(wdt_client_t *client) {
+    client->checked = 1;
+}
+
+/** \brief Check every client, and reset the watchdog if all are alive
+ *
+ *  This should be called periodically, much more often than the watchdog
+ *  timeout, from a scheduler task, eg with sched_run_every(), rather than
+ *  an interrupt, so a hung main loop stops it too. Once a client is late,
+ *  the watchdog is never reset again.
+ */
+void wdt_supervise(void);
+
+/** \brief Return which client caused the last reset
+ *
+ *  This can only be read once after the reset, and clears the watchdog
+ *  reset flag in RST.STATUS.
+ *
+ *  \return The id of the client which missed a check-in, or -EINVAL if
+ *  the last reset was not caused by the supervisor
+ */
+int wdt_culprit(void);
+
 /** \brief A macro to execute the watchdog reset instruction
  */
 /* This may already be defined by avr-libc, if someone included it's wdt.h */